@@ -18,9 +18,28 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE                     /* pthread_setaffinity_np() */
 #include "microtcp.h"
 #include "../utils/crc32.h"
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <sys/time.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <linux/net_tstamp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/random.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 
 
@@ -29,18 +48,58 @@ void *memcpy(void *dest, const void * src, size_t n);
 time_t time( time_t *second );
 
 
+static ssize_t cork_flush(microtcp_sock_t *socket, int flags);
+static int snd_flush(microtcp_sock_t *socket, int flags);
+static uint16_t rcv_window(microtcp_sock_t *socket);
+static int engine_start(microtcp_sock_t *socket);
+static int engine_stop(microtcp_sock_t *socket);
+static ssize_t engine_send(microtcp_sock_t *socket, const void *buffer, size_t length);
+static ssize_t engine_recv(microtcp_sock_t *socket, void *buffer, size_t length, size_t want);
+static size_t engine_rx_queued(microtcp_sock_t *socket);
+static ssize_t our_recvfrom(microtcp_sock_t *socket, void *buf, size_t size, uint8_t *tos);
+static ssize_t our_sendto(microtcp_sock_t *socket, const void *packet, size_t packet_size, int flags, uint64_t txtime, int probe);
+static void set_recv_timeout(microtcp_sock_t *socket, uint32_t timeout_us);
+static int seq_before(uint32_t a, uint32_t b);
+static void stash_segment(microtcp_sock_t *socket, const microtcp_header_t *header, const uint8_t *data, uint8_t tos);
+static int listener_stop(microtcp_sock_t *socket);
+static void listener_remove(microtcp_sock_t *socket);
+static struct microtcp_uring *uring_open(void);
+static void uring_close(struct microtcp_uring *u);
+static int uring_rx_ready(microtcp_sock_t *socket);
+static void uring_batch(microtcp_sock_t *socket, int on);
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Connection ID of a connection, derived from the client's initial sequence number, never 0 */
+static uint16_t conn_id_of(uint32_t isn){
+    return isn % UINT16_MAX + 1;
+}
+
+/* The connection ID as it goes out in future_use0 once the handshake is done */
+static uint32_t conn_id_opt(microtcp_sock_t *socket){
+    return (uint32_t)socket->conn_id << MICROTCP_OPT_CONN_ID_SHIFT;
+}
 
 microtcp_sock_t microtcp_socket (int domain, int type, int protocol){
     microtcp_sock_t microtcp_sock;
 
     //Allow only UDP sockets.
-    if(type != 2){
+    if((type & ~MICROTCP_SOCK_URING) != 2){
         perror(" SOCKET MUST BE A TYPE OF UDP ");
         exit( EXIT_FAILURE );
     }
     
     //Check for errors
-    microtcp_sock.sd = socket( domain , type , protocol );
+    microtcp_sock.sd = socket( domain , type & ~MICROTCP_SOCK_URING , protocol );
+    microtcp_sock.rx_sd = microtcp_sock.sd;
+    microtcp_sock.uring = NULL;
+    if((type & MICROTCP_SOCK_URING) && (microtcp_sock.uring = uring_open()) == NULL)
+        perror("(!) io_uring not available, using system calls");
 
     //Initializing microtcp_struct fields.
     microtcp_sock.state = UNBDOUND;
@@ -50,22 +109,346 @@ microtcp_sock_t microtcp_socket (int domain, int type, int protocol){
     microtcp_sock.recvbuf = NULL;
     microtcp_sock.sendbuf = NULL;
     microtcp_sock.buf_fill_level = 0;
+    microtcp_sock.rcv_wnd_adv = 0;
+    microtcp_sock.rcvbuf_max = MICROTCP_RCVBUF_MAX;
+    microtcp_sock.rcv_wscale = 0;
+    microtcp_sock.snd_wscale = 0;
+    microtcp_sock.rcv_rtt_us = 0;
+    microtcp_sock.rcv_copied = 0;
+    microtcp_sock.rcv_space_ts = 0;
     microtcp_sock.cwnd = MICROTCP_INIT_CWND;
     microtcp_sock.ssthresh = MICROTCP_INIT_SSTHRESH;
     microtcp_sock.seq_number = 0;
     microtcp_sock.ack_number = 0;
     microtcp_sock.last_ack_number = 0;
     microtcp_sock.duplicate_ack_count = 0;
+    microtcp_sock.srtt_us = 0;
+    microtcp_sock.rttvar_us = 0;
+    microtcp_sock.min_rtt_us = 0;
+    microtcp_sock.rto_us = MICROTCP_ACK_TIMEOUT_US;
+    microtcp_sock.ts_recent = 0;
+    microtcp_sock.ts_echo = 0;
+    microtcp_sock.last_xmit_ts = 0;
+    microtcp_sock.rack_xmit_ts = 0;
+    microtcp_sock.rack_rtt_us = 0;
+    microtcp_sock.prior_cwnd = 0;
+    microtcp_sock.prior_ssthresh = 0;
+    microtcp_sock.undo_ts = 0;
+    microtcp_sock.hystart_enabled = 1;
+    microtcp_sock.hystart_round_end = 0;
+    microtcp_sock.hystart_round_start = 0;
+    microtcp_sock.hystart_last_ack = 0;
+    microtcp_sock.hystart_curr_rtt_us = 0;
+    microtcp_sock.hystart_last_rtt_us = 0;
+    microtcp_sock.hystart_samples = 0;
+    microtcp_sock.pacing = MICROTCP_PACING_OFF;
+    microtcp_sock.pacing_rate = 0;
+    microtcp_sock.pacing_next_ns = 0;
+    microtcp_sock.tb_rate = 0;
+    microtcp_sock.tb_burst = 0;
+    microtcp_sock.tb_tokens = 0;
+    microtcp_sock.tb_last_ns = 0;
+    microtcp_sock.ecn = 0;
+    microtcp_sock.ecn_ok = 0;
+    microtcp_sock.ecn_ce_pending = 0;
+    microtcp_sock.ecn_echo = 0;
+    microtcp_sock.ecn_cwr_pending = 0;
+    microtcp_sock.ecn_cwr_seq = 0;
+    microtcp_sock.ack_freq = 0;
+    microtcp_sock.ack_now_pending = 0;
+    microtcp_sock.peer_ack_freq = 0;
+    microtcp_sock.delack_pending = 0;
+    microtcp_sock.delack_ts = 0;
+    microtcp_sock.rcvtimeo_us = 0;
+    microtcp_sock.rx_queued = 0;
+    microtcp_sock.pingpong = 0;
+    microtcp_sock.last_data_rcv_ts = 0;
+    microtcp_sock.stash = NULL;
+    microtcp_sock.stash_len = 0;
+    microtcp_sock.stash_tos = 0;
+    microtcp_sock.cork = 0;
+    microtcp_sock.nagle = 0;
+    microtcp_sock.mss = MICROTCP_MSS;
+    microtcp_sock.local_mss = MICROTCP_MAX_MSS;
+    microtcp_sock.peer_mss = MICROTCP_MSS;
+    microtcp_sock.rcv_mss = MICROTCP_MSS;
+    microtcp_sock.rcv_leftover = NULL;
+    microtcp_sock.rcv_leftover_off = 0;
+    microtcp_sock.rcv_leftover_len = 0;
+    microtcp_sock.rcvlowat = 1;
+    microtcp_sock.plpmtud = 1;
+    microtcp_sock.plpmtud_high = MICROTCP_MSS;
+    microtcp_sock.plpmtud_probe = 0;
+    microtcp_sock.plpmtud_inflight = 0;
+    microtcp_sock.plpmtud_fails = 0;
+    microtcp_sock.plpmtud_rtos = 0;
+    microtcp_sock.plpmtud_raise_ts = 0;
+    microtcp_sock.xmit_pad = 0;
+    microtcp_sock.cork_buf = NULL;
+    memset(&microtcp_sock.snd, 0, sizeof(microtcp_sndq_t));
+    microtcp_sock.sndbuf_max = MICROTCP_SNDBUF_DEFAULT;
+    microtcp_sock.sndlowat = MICROTCP_SNDLOWAT_DEFAULT;
+    microtcp_sock.cork_len = 0;
+    microtcp_sock.cork_ts = 0;
+    microtcp_sock.engine = NULL;
+    microtcp_sock.listener = NULL;
+    microtcp_sock.syncookies = MICROTCP_SYNCOOKIES_AUTO;
+    microtcp_sock.nonblock = 0;
+    microtcp_sock.busy_poll_us = 0;
+    microtcp_sock.poll_error = 0;
+    microtcp_sock.conn_id = 0;
+    memset(&microtcp_sock.flow, 0, sizeof(microtcp_flow_key_t));
     microtcp_sock.packets_send = 0;
     microtcp_sock.packets_received = 0;
     microtcp_sock.packets_lost = 0;
     microtcp_sock.bytes_send = 0;
     microtcp_sock.bytes_received =0;
     microtcp_sock.bytes_lost = 0;
+    microtcp_sock.spurious_retransmits = 0;
+    microtcp_sock.ecn_ce_received = 0;
+    microtcp_sock.acks_delayed = 0;
+    microtcp_sock.window_probes = 0;
+    microtcp_sock.plpmtud_probes = 0;
+    microtcp_sock.busy_poll_ns = 0;
+    microtcp_sock.busy_poll_wasted_ns = 0;
+    microtcp_sock.busy_poll_hits = 0;
+    microtcp_sock.busy_poll_misses = 0;
 
     return microtcp_sock;
 }
 
+int microtcp_setsockopt (microtcp_sock_t *socket, int optname, const void *optval, socklen_t optlen){
+    int pacing = 0;
+
+    //The engine owns the connection's state while it runs
+    if(socket->engine != NULL && optname != MICROTCP_SO_ENGINE){
+        errno = EBUSY;
+        return -1;
+    }
+
+    switch(optname){
+    case MICROTCP_SO_PACING:
+        if(optlen != sizeof(int)) break;
+        pacing = *(const int *)optval;
+        if(pacing == MICROTCP_PACING_TXTIME){
+            struct sock_txtime txtime = { CLOCK_MONOTONIC, 0 };
+            if(setsockopt(socket->sd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) == -1){
+                perror("(!) SO_TXTIME not available, pacing with timers");
+                pacing = MICROTCP_PACING_TIMER;
+            }
+        }
+        else if(pacing != MICROTCP_PACING_OFF && pacing != MICROTCP_PACING_TIMER) break;
+        socket->pacing = pacing;
+        socket->pacing_next_ns = 0;
+        return 0;
+    case MICROTCP_SO_PACING_RATE:
+        if(optlen != sizeof(uint64_t)) break;
+        socket->pacing_rate = *(const uint64_t *)optval;
+        return 0;
+    case MICROTCP_SO_RATE_LIMIT:
+        if(optlen != sizeof(microtcp_rate_limit_t)) break;
+        socket->tb_rate = ((const microtcp_rate_limit_t *)optval)->rate;
+        socket->tb_burst = max(((const microtcp_rate_limit_t *)optval)->burst, sizeof(microtcp_header_t) + MICROTCP_MAX_MSS);
+        socket->tb_tokens = socket->tb_burst;
+        socket->tb_last_ns = now_ns();
+        return 0;
+    case MICROTCP_SO_ECN:
+        if(optlen != sizeof(int)) break;
+        socket->ecn = *(const int *)optval != 0;
+        return 0;
+    case MICROTCP_SO_ACK_FREQ:
+        if(optlen != sizeof(int) || *(const int *)optval < 0 || *(const int *)optval > MICROTCP_ACK_FREQ_MAX) break;
+        socket->ack_freq = *(const int *)optval;
+        return 0;
+    case MICROTCP_SO_CORK:
+    case MICROTCP_SO_NAGLE:
+        if(optlen != sizeof(int)) break;
+        if(optname == MICROTCP_SO_CORK) socket->cork = *(const int *)optval != 0;
+        else socket->nagle = *(const int *)optval != 0;
+        //Uncorking sends whatever was held back
+        if(*(const int *)optval == 0 && cork_flush(socket, 0) == -1) return -1;
+        return 0;
+    case MICROTCP_SO_MAXSEG:
+        if(optlen != sizeof(int) || *(const int *)optval < MICROTCP_MIN_MSS || *(const int *)optval > MICROTCP_MAX_MSS) break;
+        socket->local_mss = *(const int *)optval;
+        return 0;
+    case MICROTCP_SO_PLPMTUD:
+        if(optlen != sizeof(int)) break;
+        socket->plpmtud = *(const int *)optval != 0;
+        return 0;
+    case MICROTCP_SO_HYSTART:
+        if(optlen != sizeof(int)) break;
+        socket->hystart_enabled = *(const int *)optval != 0;
+        return 0;
+    case MICROTCP_SO_RCVLOWAT:
+        if(optlen != sizeof(int) || *(const int *)optval < 0) break;
+        socket->rcvlowat = max(*(const int *)optval, 1);
+        return 0;
+    case MICROTCP_SO_SNDBUF:
+        if(optlen != sizeof(int) || *(const int *)optval < MICROTCP_MAX_MSS) break;
+        socket->sndbuf_max = *(const int *)optval;
+        return 0;
+    case MICROTCP_SO_SNDLOWAT:
+        if(optlen != sizeof(int) || *(const int *)optval < 1) break;
+        socket->sndlowat = *(const int *)optval;
+        return 0;
+    case MICROTCP_SO_RCVBUF:
+        if(optlen != sizeof(int) || *(const int *)optval < 2 * MICROTCP_MAX_MSS || *(const int *)optval > MICROTCP_RECVBUF_LEN) break;
+        socket->rcvbuf_max = *(const int *)optval;
+        return 0;
+    case MICROTCP_SO_SYNCOOKIES:
+        if(optlen != sizeof(int) || *(const int *)optval < MICROTCP_SYNCOOKIES_OFF || *(const int *)optval > MICROTCP_SYNCOOKIES_ALWAYS) break;
+        socket->syncookies = *(const int *)optval;
+        return 0;
+    case MICROTCP_SO_NONBLOCK:
+        if(optlen != sizeof(int)) break;
+        socket->nonblock = *(const int *)optval != 0;
+        return 0;
+    case MICROTCP_SO_BUSY_POLL:
+        if(optlen != sizeof(int) || *(const int *)optval < 0) break;
+        socket->busy_poll_us = *(const int *)optval;
+        //The connections of a listener read a socketpair, the port is the listener's
+        if(socket->rx_sd == socket->sd && setsockopt(socket->sd, SOL_SOCKET, SO_BUSY_POLL, optval, sizeof(int)) == -1)
+            perror("(!) SO_BUSY_POLL not available, spinning in user space only");
+        return 0;
+    case MICROTCP_SO_ENGINE:
+        if(optlen != sizeof(int)) break;
+        return *(const int *)optval ? engine_start(socket) : engine_stop(socket);
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Called once both ends agreed on ECN. Our datagrams get marked ECT(0) and
+ * the kernel reports the TOS byte of the ones we receive, so that we can see
+ * CE marks set by the routers on the way.
+ */
+static void ecn_setup(microtcp_sock_t *socket){
+    int tos = MICROTCP_ECN_ECT0, on = 1;
+
+    //The connections of a listener share its socket, our_sendto() marks their datagrams one by one
+    if(socket->rx_sd == socket->sd &&
+       (setsockopt(socket->sd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) == -1 ||
+        setsockopt(socket->sd, IPPROTO_IP, IP_RECVTOS, &on, sizeof(on)) == -1)){
+        perror("(!) Could not enable ECN");
+        return;
+    }
+    socket->ecn_ok = 1;
+    socket->ecn_cwr_seq = socket->seq_number;
+}
+
+/*
+ * PLPMTUD probes must not get fragmented, so the DF bit is set and the
+ * kernel's own idea of the path MTU is ignored. It is a setting of the UDP
+ * socket, a listener's connections take it from the listening socket.
+ */
+static void pmtu_setup(microtcp_sock_t *socket){
+    int pmtudisc = IP_PMTUDISC_PROBE;
+
+    if(socket->plpmtud && setsockopt(socket->sd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc, sizeof(pmtudisc)) == -1){
+        perror("(!) Could not set IP_MTU_DISCOVER, not probing for larger segments");
+        socket->plpmtud = 0;
+    }
+}
+
+/*
+ * Called once the handshake told us the largest segment the peer accepts.
+ * We start at the size every path carries and with PLPMTUD search up from
+ * there.
+ */
+static void mss_setup(microtcp_sock_t *socket, uint32_t peer_mss){
+    socket->peer_mss = peer_mss != 0 ? peer_mss : MICROTCP_MSS;
+    socket->mss = min(MICROTCP_MSS, min(socket->local_mss, socket->peer_mss));
+    socket->plpmtud_high = min(socket->local_mss, socket->peer_mss);
+    socket->plpmtud_probe = 0;
+    socket->plpmtud_inflight = 0;
+    socket->plpmtud_fails = 0;
+    socket->plpmtud_rtos = 0;
+    socket->plpmtud_raise_ts = microtcp_ts_now();
+}
+
+/*
+ * Sizes the queue of the UDP socket for a receive buffer of size bytes. The
+ * kernel counts its own overhead against the queue and doubles what it is
+ * asked for to make up for it. Returns how much of the buffer the queue can
+ * back, less than size if the kernel caps it at net.core.rmem_max.
+ */
+static size_t rcvbuf_resize(microtcp_sock_t *socket, size_t size){
+    int val = (int)size;
+    socklen_t len = sizeof(val);
+
+    //The queue of a listener's connection is sized for rcvbuf_max when it is accepted
+    if(socket->rx_sd != socket->sd) return size;
+    if(setsockopt(socket->sd, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)) == -1 &&
+       setsockopt(socket->sd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)) == -1){
+        perror("(!) Could not resize the receive buffer");
+        return size;
+    }
+    if(getsockopt(socket->sd, SOL_SOCKET, SO_RCVBUF, &val, &len) == -1) return size;
+    return min(size, (size_t)val / 2);
+}
+
+/*
+ * Called before our SYN or SYN-ACK goes out. The receive buffer starts small
+ * and auto-tuning grows it as the flow needs, so the window scale is chosen
+ * for the largest size it may grow to.
+ */
+static void rcvbuf_setup(microtcp_sock_t *socket){
+    socket->rcv_wscale = 0;
+    while(socket->rcv_wscale < MICROTCP_MAX_WSCALE && ((size_t)UINT16_MAX << socket->rcv_wscale) < socket->rcvbuf_max)
+        socket->rcv_wscale++;
+    socket->init_win_size = rcvbuf_resize(socket, min(MICROTCP_RCVBUF_INIT, socket->rcvbuf_max));
+    socket->rcv_wnd_adv = 0;
+    socket->rcv_rtt_us = 0;
+    socket->rcv_copied = 0;
+    socket->rcv_space_ts = microtcp_ts_now();
+}
+
+/* Windows are scaled only if the peer's SYN or SYN-ACK had the option too */
+static void wscale_setup(microtcp_sock_t *socket, uint32_t options){
+    if(options & MICROTCP_OPT_WSCALE){
+        socket->snd_wscale = min((options >> MICROTCP_OPT_WSCALE_SHIFT) & 0xff, MICROTCP_MAX_WSCALE);
+    }
+    else{
+        socket->snd_wscale = 0;
+        socket->rcv_wscale = 0;
+    }
+}
+
+/*
+ * Waits until deadline for a segment of the handshake. Returns its length
+ * with its header copied to header, -2 once the deadline passed, or -1 if it
+ * was not received correctly. The segment stays in socket->recvbuf with its
+ * checksum zeroed.
+ */
+static ssize_t handshake_recv(microtcp_sock_t *socket, size_t size, uint32_t deadline, microtcp_header_t *header){
+    uint32_t now = microtcp_ts_now(), checksum_num = 0;
+    ssize_t result = 0;
+
+    if(!seq_before(now, deadline)) return -2;
+    set_recv_timeout(socket, deadline - now);
+    result = our_recvfrom(socket, socket->recvbuf, size, NULL);
+    if(result == -1){
+        if(errno == EAGAIN || errno == EWOULDBLOCK) return -2;
+        perror("(!) COULD NOT RECEIVE PACKET!\n");
+        return -1;
+    }
+    if(result < (ssize_t)sizeof(microtcp_header_t)) return -1;
+
+    //Check if checksum is correct
+    memcpy(header, socket->recvbuf, sizeof(microtcp_header_t));
+    memset(socket->recvbuf + offsetof(microtcp_header_t, checksum), 0, sizeof(header->checksum));
+    if(sizeof(microtcp_header_t) + (size_t)header->data_len <= (size_t)result)
+        checksum_num = crc32(socket->recvbuf, sizeof(microtcp_header_t) + header->data_len);
+    if(header->checksum != checksum_num){
+        perror("(!) Package has not been received correctly!\n");
+        return -1;
+    }
+    return result;
+}
+
 int microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len){
     int bind_val;
     bind_val = bind(socket->sd, address, address_len);
@@ -78,8 +461,9 @@ int microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address, sock
 int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len){
     size_t client_seq_num = 0;
     microtcp_header_t *header = malloc(sizeof(microtcp_header_t));
-    uint32_t retrieved_checksum = 0, checksum_num = 0, server_seq_num = 0;
-    struct sockaddr addr = *address;
+    uint32_t checksum_num = 0, server_seq_num = 0, timeout_us = MICROTCP_SYN_RTO_US, deadline = 0;
+    ssize_t result = 0;
+    int retries = 0;
 
     if(header == NULL){
         printf("(!) Memory allocation failed!\n");
@@ -110,19 +494,20 @@ int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address, s
     client_seq_num = (size_t)rand();
     socket->seq_number = client_seq_num;
     socket->relative_seq_number = client_seq_num;
-    socket->init_win_size = MICROTCP_WIN_SIZE - 32;
-    socket->curr_win_size = MICROTCP_WIN_SIZE - 32;
+    rcvbuf_setup(socket);
 
     //Create header of the SYN packet
     header->data_len = 0;
     header->ack_number = 0;
     header->seq_number = client_seq_num;
-    header->future_use0 = 0;
+    header->future_use0 = socket->local_mss;   //MSS option
+    header->future_use0 |= MICROTCP_OPT_WSCALE | (uint32_t)socket->rcv_wscale << MICROTCP_OPT_WSCALE_SHIFT;
     header->future_use1 = 0;
     header->future_use2 = 0;
-    header->window = socket->init_win_size; //NOT SURE
+    header->window = min(socket->init_win_size, UINT16_MAX);   //Never scaled
     header->checksum = 0;
     header->control = 0b0000000000000010;   //SYN Package
+    if(socket->ecn) header->control |= MICROTCP_CTRL_ECE | MICROTCP_CTRL_CWR;   //Offer ECN
 
   
     memcpy(socket->sendbuf, header, sizeof(microtcp_header_t));
@@ -132,36 +517,36 @@ int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address, s
     memset(socket->sendbuf,0,sizeof(microtcp_header_t));
     memcpy(socket->sendbuf, header, sizeof(microtcp_header_t));
    
-    if(sendto(socket->sd, socket->sendbuf, sizeof(microtcp_header_t), 0, socket->server_ip, address_len) == -1){ //SYN
-        perror("(!) COULD NOT SEND SYN PACKET!\n");
-        exit(EXIT_FAILURE);
-    }
-    else{printf("SENT SYN PACKAGE YAY!\n\n");}
-
-
-
-    //Receiving SYN_ACK
-    if(recvfrom(socket->sd, socket->recvbuf, sizeof(microtcp_header_t),0, &addr, &address_len) == -1){ //SYN
-        perror("(!) COULD NOT RECEIVE SYN_ACK PACKET!\n");
-        exit(0);
-    }
-    else printf("RECEIVED SYN_ACK PACKAGE YAY!\n");
-    
-    memset(header,0,sizeof(microtcp_header_t));
-    //Retrieve the data of the header of the received packet
-    memcpy(header, socket->recvbuf, sizeof(microtcp_header_t));
-
-    //Check if checksum is correct
-    retrieved_checksum = header->checksum;
-    header->checksum = 0;
-    memset(socket->recvbuf,0,sizeof(microtcp_header_t));
-    memcpy(socket->recvbuf, header, sizeof(microtcp_header_t));
-    checksum_num = crc32(socket->recvbuf,sizeof(microtcp_header_t));
-    if(retrieved_checksum != checksum_num){
-        perror("(!) Package has not been received correctly!\n");
-        exit(EXIT_FAILURE);
+    //The SYN goes out again, with exponential backoff, until a SYN_ACK for it comes back
+    for(retries = 0; ; retries++){
+        if(sendto(socket->sd, socket->sendbuf, sizeof(microtcp_header_t), 0, socket->server_ip, address_len) == -1){ //SYN
+            perror("(!) COULD NOT SEND SYN PACKET!\n");
+            exit(EXIT_FAILURE);
+        }
+        else{printf("SENT SYN PACKAGE YAY!\n\n");}
+
+        //Receiving SYN_ACK
+        deadline = microtcp_ts_now() + timeout_us;
+        do result = handshake_recv(socket, sizeof(microtcp_header_t), deadline, header);
+        while(result == -1 || (result >= 0 && ((header->control & (MICROTCP_CTRL_SYN | MICROTCP_CTRL_ACK)) != (MICROTCP_CTRL_SYN | MICROTCP_CTRL_ACK) ||
+                                               header->ack_number != (uint32_t)(client_seq_num + 1))));
+        if(result >= 0) break;
+        if(retries == MICROTCP_SYN_RETRIES){
+            errno = ETIMEDOUT;
+            perror("(!) COULD NOT RECEIVE SYN_ACK PACKET!\n");
+            free(header);
+            free(socket->server_ip);
+            free(socket->recvbuf);
+            free(socket->sendbuf);
+            socket->server_ip = NULL;
+            socket->recvbuf = NULL;
+            socket->sendbuf = NULL;
+            socket->state = INVALID;
+            return -1;
+        }
+        timeout_us = min(2 * (uint64_t)timeout_us, MICROTCP_MAX_RTO_US);
     }
-    printf("Package received correctly\n");
+    printf("RECEIVED SYN_ACK PACKAGE YAY!\n");
     
     printf("SYN_ACK - checksum: %d\n",header->checksum);
     printf("SYN_ACK - future_use0: %d\n",header->future_use0);
@@ -175,6 +560,12 @@ int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address, s
     printf("\n\n");
 
     socket->seq_number = client_seq_num;
+    socket->conn_id = conn_id_of(client_seq_num);
+    if(socket->ecn && (header->control & MICROTCP_CTRL_ECE)) ecn_setup(socket);
+    wscale_setup(socket, header->future_use0);
+    pmtu_setup(socket);
+    mss_setup(socket, header->future_use0 & MICROTCP_OPT_MSS_MASK);
+    socket->curr_win_size = header->window;
 
 
     //Save important data and reset header
@@ -185,10 +576,10 @@ int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address, s
     header->data_len = 0;
     header->ack_number = server_seq_num + 1;
     header->seq_number = client_seq_num + 1;
-    header->future_use0 = 0;
+    header->future_use0 = conn_id_opt(socket);
     header->future_use1 = 0;
     header->future_use2 = 0;
-    header->window = socket->init_win_size; //NOT SURE
+    header->window = rcv_window(socket);
     header->checksum = 0;
     header->control = 0b000000000001000;   //SYN Package
   
@@ -209,14 +600,16 @@ int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address, s
 
 
     free(socket->recvbuf);
-    socket->recvbuf = malloc(MICROTCP_RECVBUF_LEN);  //Allocate space for the recvbuffer and initialize
-    if(socket->recvbuf == NULL){                      //with win_size
+    socket->recvbuf = malloc(sizeof(microtcp_header_t) + MICROTCP_MAX_MSS);  //Room for the largest segment, the rest
+    if(socket->recvbuf == NULL){                                           //waits in the queue of the UDP socket
         printf("(!) Memory allocation failed!\n");
         exit(EXIT_FAILURE);
     }
     memset(socket->recvbuf, 0, sizeof(socket->recvbuf));
     free(header);
     free(socket->sendbuf);
+    socket->sendbuf = NULL;
+    set_recv_timeout(socket, 0);
     socket->state = ESTABLISHED;
 
 
@@ -224,46 +617,60 @@ int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address, s
 
 }
 
-int microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,socklen_t address_len){
-    size_t server_seq_num = 0;
-    struct sockaddr_in *add_in;
+/*
+ * Server side of the handshake: takes the options of the client's SYN and
+ * builds our SYN-ACK, with iss as our initial sequence number. The
+ * connection's state depends on nothing else, a listener answers the SYN
+ * with a copy of the socket and sets the connection up the same way later.
+ */
+static void syn_setup(microtcp_sock_t *socket, const microtcp_header_t *syn, uint32_t iss, microtcp_header_t *synack){
+    int ecn_offered = (syn->control & (MICROTCP_CTRL_ECE | MICROTCP_CTRL_CWR)) == (MICROTCP_CTRL_ECE | MICROTCP_CTRL_CWR);
+
+    socket->conn_id = conn_id_of(syn->seq_number);
+    rcvbuf_setup(socket);
+    wscale_setup(socket, syn->future_use0);
+    mss_setup(socket, syn->future_use0 & MICROTCP_OPT_MSS_MASK);
+    socket->curr_win_size = syn->window;
+    socket->seq_number = iss;
+    socket->relative_seq_number = iss;
+    socket->ack_number = syn->seq_number + 1;
+
+    //Create header of the SYN_ACK package
+    memset(synack, 0, sizeof(microtcp_header_t));
+    synack->data_len = 0;
+    synack->ack_number = socket->ack_number;
+    synack->seq_number = socket->seq_number;
+    synack->future_use0 = socket->local_mss;   //MSS option
+    if(syn->future_use0 & MICROTCP_OPT_WSCALE)
+        synack->future_use0 |= MICROTCP_OPT_WSCALE | (uint32_t)socket->rcv_wscale << MICROTCP_OPT_WSCALE_SHIFT;
+    synack->future_use1 = 0;
+    synack->future_use2 = 0;
+    synack->window = min(socket->init_win_size, UINT16_MAX);   //Never scaled
+    synack->checksum = 0;
+    synack->control = 0b0000000000001010; //Ack Syn
+    if(socket->ecn && ecn_offered){
+        synack->control |= MICROTCP_CTRL_ECE;   //Accept ECN
+        ecn_setup(socket);
+    }
+    synack->checksum = crc32((const uint8_t *)synack, sizeof(microtcp_header_t));
+}
+
+/*
+ * Server side of the handshake, from the SYN waiting in socket->recvbuf on.
+ * The client's address is in socket->client_ip.
+ */
+static int accept_syn(microtcp_sock_t *socket){
     microtcp_header_t *header = malloc(sizeof(microtcp_header_t));
-    microtcp_header_t data;
-    uint32_t retrieved_checksum = 0,checksum_num = 0, clients_seq_num = 0;
+    microtcp_header_t synack;
+    uint32_t retrieved_checksum = 0, checksum_num = 0, timeout_us = MICROTCP_SYN_RTO_US, deadline = 0;
+    ssize_t result = -2;
+    int retries = 0;
 
     if(header == NULL){
         printf("(!) Memory allocation failed!\n");
         exit(EXIT_FAILURE);
     }
 
-    socket->recvbuf = malloc(sizeof(microtcp_header_t));  //Allocate space for the recvbuffer and initialize
-    if(socket->recvbuf == NULL){
-        printf("(!) Memory allocation failed!\n");
-        exit(EXIT_FAILURE);
-    }
-    memset(socket->recvbuf, 0, sizeof(microtcp_header_t));
-
-    socket->sendbuf = malloc(sizeof(microtcp_header_t));  //Allocate space for the sendbuffer and initialize
-    if(socket->sendbuf == NULL){
-        printf("(!)Memory allocation failed!\n");
-        exit(EXIT_FAILURE);
-    }
-    memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
-    //Find clients' address
-    add_in = (struct sockaddr_in *)address;
-    add_in->sin_family = AF_INET;
-    add_in->sin_addr.s_addr = INADDR_ANY;   
-    
-    socket->server_ip = NULL;
-    socket->client_ip = add_in;
-    socklen_t addrlen = sizeof(*add_in);
-
-    if(recvfrom(socket->sd,socket->recvbuf,sizeof(microtcp_header_t), 0,(struct sockaddr *)socket->client_ip, &addrlen) == -1){ //SYN
-        perror("(!) COULD NOT RECEIVE PACKET!\n");
-        return -1;
-    }
-    else printf("RECEIVED SYN PACKAGE YAY!\n");
-
     //Retrieve the data of the header of the received packet
     memcpy(header, socket->recvbuf, sizeof(microtcp_header_t));
 
@@ -274,6 +681,7 @@ int microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,socklen_t
     checksum_num = crc32(socket->recvbuf, sizeof(microtcp_header_t));
     if(retrieved_checksum != checksum_num){
         perror("(!) Package has not been received correctly!\n");
+        free(header);
         return -1;
     }
     printf("Package received correctly\n");
@@ -287,65 +695,48 @@ int microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,socklen_t
     printf("SYN - data_len: %d\n",header->data_len);
     printf("SYN - window: %d\n",header->window);
     printf("\n\n");
-    
-    clients_seq_num = header->seq_number;
-
-    //Create header of the ACK package
-    memset(header,0,sizeof(microtcp_header_t));
-    server_seq_num = (size_t)rand();
-    //(size_t)rand();
-    socket->seq_number = server_seq_num;
-    socket->relative_seq_number = server_seq_num;
-    socket->ack_number = clients_seq_num + 1;
-    socket->init_win_size = MICROTCP_WIN_SIZE - 32;
-    socket->curr_win_size = MICROTCP_WIN_SIZE - 32;
-    
-    header->data_len = 0;
-    header->ack_number = socket->ack_number;
-    header->seq_number = socket->seq_number;
-    header->future_use0 = 0;
-    header->future_use1 = 0;
-    header->future_use2 = 0;
-    header->window = socket->init_win_size;
-    header->checksum = 0;
-    header->control = 0b0000000000001010; //Ack Syn
-
-    
-    memcpy(socket->sendbuf, header, sizeof(microtcp_header_t));
-    checksum_num = crc32(socket->sendbuf, sizeof(microtcp_header_t));
-    header->checksum = checksum_num;
-    memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
-    memcpy(socket->sendbuf, header, sizeof(microtcp_header_t));
- 
-    //Sending SYN_ACK 
-    if(sendto(socket->sd, socket->sendbuf, sizeof(microtcp_header_t), 0, (struct sockaddr *)add_in, addrlen) == -1){
-        perror("(!) COULD NOT SENT SYN_ACK PACKET!\n");
-        return -1;
-    }
-    else printf("SENT SYN_ACK PACKAGE YAY!\n\n");
 
+    pmtu_setup(socket);
+    syn_setup(socket, header, (uint32_t)rand(), &synack);
+    memcpy(socket->sendbuf, &synack, sizeof(microtcp_header_t));
 
-    //Reciving ACK 
-    memset(header, 0, sizeof(microtcp_header_t));
-    if(recvfrom(socket->sd,socket->recvbuf,sizeof(microtcp_header_t), 0,(struct sockaddr *)add_in, &addrlen) == -1){ //ACK
-        perror("(!) COULD NOT RECEIVE ACK PACKET!\n");
-        return -1;
+    //If the ACK gets lost, the client's first data completes the handshake, there has to be room for it
+    free(socket->recvbuf);
+    socket->recvbuf = malloc(sizeof(microtcp_header_t) + MICROTCP_MAX_MSS);
+    if(socket->recvbuf == NULL){
+        printf("(!) Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
     }
-    else printf("RECEIVED ACK PACKAGE YAY!\n");
 
-    //Retrieve the data of the header of the received packet
-    memcpy(header, socket->recvbuf, sizeof(microtcp_header_t));
+    while(1){
+        //The SYN_ACK goes out again when it times out, with exponential backoff,
+        //or right away when the client sends its SYN again because it did not get it
+        if(result == -2 || (result >= 0 && (header->control & MICROTCP_CTRL_SYN))){
+            if(retries++ > MICROTCP_SYNACK_RETRIES){
+                errno = ETIMEDOUT;
+                perror("(!) COULD NOT RECEIVE ACK PACKET!\n");
+                free(header);
+                return -1;
+            }
+            if(result == -2){
+                deadline = microtcp_ts_now() + timeout_us;
+                timeout_us = min(2 * (uint64_t)timeout_us, MICROTCP_MAX_RTO_US);
+            }
+            //Sending SYN_ACK
+            if(sendto(socket->sd, socket->sendbuf, sizeof(microtcp_header_t), 0, (struct sockaddr *)socket->client_ip, sizeof(*(socket->client_ip))) == -1){
+                perror("(!) COULD NOT SENT SYN_ACK PACKET!\n");
+                free(header);
+                return -1;
+            }
+            else printf("SENT SYN_ACK PACKAGE YAY!\n\n");
+        }
 
-    //Check if checksum is correct
-    retrieved_checksum = header->checksum;
-    header->checksum = 0;
-    memcpy (socket->recvbuf, header, sizeof(microtcp_header_t));
-    checksum_num = crc32(socket->recvbuf, sizeof(microtcp_header_t));
-    if(retrieved_checksum != checksum_num){
-        perror("(!) Package has not been received correctly!\n");
-        return -1;
+        //Reciving ACK
+        result = handshake_recv(socket, sizeof(microtcp_header_t) + MICROTCP_MAX_MSS, deadline, header);
+        if(result >= 0 && !(header->control & MICROTCP_CTRL_SYN) && (header->control & MICROTCP_CTRL_ACK) &&
+           header->ack_number == (uint32_t)(socket->seq_number + 1)) break;
     }
-    printf("Package received correctly\n");
+    printf("RECEIVED ACK PACKAGE YAY!\n");
 
     //Print to check
     printf("ACK - checksum: %d\n",header->checksum);
@@ -359,21 +750,54 @@ int microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,socklen_t
     printf("ACK - window: %d\n",header->window);
     printf("\n\n");
 
+    //Data that came instead of the ACK is kept for microtcp_recv()
+    if(header->data_len != 0 || (header->control & MICROTCP_CTRL_FIN))
+        stash_segment(socket, header, socket->recvbuf + sizeof(microtcp_header_t), 0);
 
     socket->state = ESTABLISHED;
     socket->seq_number += 1;
 
-    free(socket->recvbuf);
-    socket->recvbuf = malloc(MICROTCP_RECVBUF_LEN);  //Allocate space for the recvbuffer and initialize
-    if(socket->recvbuf == NULL){                      //with init_win_size
+    memset(socket->recvbuf, 0, sizeof(microtcp_header_t));
+    free(header);
+    free(socket->sendbuf);
+    socket->sendbuf = NULL;
+    set_recv_timeout(socket, 0);
+
+    return 0;
+}
+
+int microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,socklen_t address_len){
+    struct sockaddr_in *add_in;
+
+    socket->recvbuf = malloc(sizeof(microtcp_header_t));  //Allocate space for the recvbuffer and initialize
+    if(socket->recvbuf == NULL){
         printf("(!) Memory allocation failed!\n");
         exit(EXIT_FAILURE);
     }
     memset(socket->recvbuf, 0, sizeof(microtcp_header_t));
-    free(header);
-    free(socket->sendbuf);
+
+    socket->sendbuf = malloc(sizeof(microtcp_header_t));  //Allocate space for the sendbuffer and initialize
+    if(socket->sendbuf == NULL){
+        printf("(!)Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
+    //Find clients' address
+    add_in = (struct sockaddr_in *)address;
+    add_in->sin_family = AF_INET;
+    add_in->sin_addr.s_addr = INADDR_ANY;   
     
-    return 0;
+    socket->server_ip = NULL;
+    socket->client_ip = add_in;
+    socklen_t addrlen = sizeof(*add_in);
+
+    if(recvfrom(socket->sd,socket->recvbuf,sizeof(microtcp_header_t), 0,(struct sockaddr *)socket->client_ip, &addrlen) == -1){ //SYN
+        perror("(!) COULD NOT RECEIVE PACKET!\n");
+        return -1;
+    }
+    else printf("RECEIVED SYN PACKAGE YAY!\n");
+
+    return accept_syn(socket);
 }
 
 int microtcp_shutdown (microtcp_sock_t *socket, int how){
@@ -382,6 +806,14 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
     microtcp_header_t data;
     uint32_t retrieved_checksum = 0,checksum_num = 0, clients_seq_num = 0;
 
+    if(socket->state == LISTEN){
+        free(header);
+        return listener_stop(socket);
+    }
+
+    //The engine hands the connection back with what the application queued last
+    if(engine_stop(socket) == -1) printf("(!) Protocol I/O thread failed!\n");
+
     if(header == NULL){
         printf("(!) Memory allocation failed!\n");
         exit(EXIT_FAILURE);
@@ -395,11 +827,17 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
     }
     memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
 
+    //Send what we held back, and don't leave the peer waiting for an ACK we were holding to piggyback
+    if(snd_flush(socket, 0) == -1) printf("(!) Error sending queued data!\n");
+    if(socket->delack_pending && our_send(socket, NULL, 0, 0) == -1){
+        printf("(!) Error sending ACK packet!\n");
+    }
+    //The teardown waits for the peer's answers for as long as it takes, whatever the last read waited for
+    set_recv_timeout(socket, 0);
+
     //Server-side
     if(socket->state == CLOSING_BY_PEER){
         printf("\nSERVER SIDE!\n");
-        //Find clients' address
-        socklen_t addrlen = sizeof(*(socket->client_ip));
 
 
         //Sending ACK package
@@ -411,7 +849,7 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
         header->data_len = 0;
         header->ack_number = clients_seq_num + 1;
         header->seq_number = 0;
-        header->future_use0 = 0;
+        header->future_use0 = conn_id_opt(socket);
         header->future_use1 = 0;
         header->future_use2 = 0;
         header->window = socket->init_win_size; //NOT SURE
@@ -426,7 +864,7 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
         memcpy(socket->sendbuf, header, sizeof(microtcp_header_t));
     
         //Sending SYN_ACK 
-        if(sendto(socket->sd, socket->sendbuf, sizeof(microtcp_header_t), 0, (struct sockaddr *)socket->client_ip, sizeof(*(socket->client_ip))) == -1){
+        if(our_sendto(socket, socket->sendbuf, sizeof(microtcp_header_t), 0, 0, 0) == -1){
             perror("(!) COULD NOT SEND ACK PACKET!\n");
             exit(EXIT_FAILURE);
         }
@@ -444,7 +882,7 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
         header->data_len = 0;
         header->ack_number = 0;
         header->seq_number = server_seq_num;
-        header->future_use0 = 0;
+        header->future_use0 = conn_id_opt(socket);
         header->future_use1 = 0;
         header->future_use2 = 0;
         header->window = socket->curr_win_size; //NOT SURE
@@ -459,7 +897,7 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
         memcpy(socket->sendbuf, header, sizeof(microtcp_header_t));
     
         //Sending SYN_ACK 
-        if(sendto(socket->sd, socket->sendbuf, sizeof(microtcp_header_t), 0, (struct sockaddr *)socket->client_ip, sizeof(*(socket->client_ip))) == -1){
+        if(our_sendto(socket, socket->sendbuf, sizeof(microtcp_header_t), 0, 0, 0) == -1){
             perror("(!) COULD NOT SEND ACK PACKET!\n");
             exit(EXIT_FAILURE);
         }
@@ -467,7 +905,7 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
 
 
         //Reveiving ACK
-        if(recvfrom(socket->sd,socket->recvbuf,sizeof(microtcp_header_t),0,(struct sockaddr *)socket->client_ip, &addrlen) == -1){ //SYN
+        if(our_recvfrom(socket, socket->recvbuf, sizeof(microtcp_header_t), NULL) == -1){ //SYN
             perror("(!) COULD NOT RECEIVE PACKET!\n");
             exit(EXIT_FAILURE);
         }
@@ -504,16 +942,16 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
 
         printf("(!) Connection closed by peer!\n");
     }
-    //Client-side
+    //Client-side, or a server closing first: our_sendto() picks the peer's address either way
     else{
         printf("\nCLIENT SIDE!\n");
         //Create header of the ACK package
         memset(header,0,sizeof(microtcp_header_t));
 
         header->data_len = 0;
-        header->ack_number = 0;
+        header->ack_number = socket->ack_number;
         header->seq_number = socket->seq_number;
-        header->future_use0 = 0;
+        header->future_use0 = conn_id_opt(socket);
         header->future_use1 = 0;
         header->future_use2 = 0;
         header->window = socket->curr_win_size; //NOT SURE
@@ -528,7 +966,7 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
         memcpy(socket->sendbuf, header, sizeof(microtcp_header_t));
     
         //Sending SYN_ACK 
-        if(sendto(socket->sd, socket->sendbuf, sizeof(microtcp_header_t), 0, (struct sockaddr *)socket->server_ip, sizeof(*(socket->server_ip))) == -1){
+        if(our_sendto(socket, socket->sendbuf, sizeof(microtcp_header_t), 0, 0, 0) == -1){
             perror("(!) COULD NOT SEND FIN_ACK PACKET!\n");
             exit(EXIT_FAILURE);
         }
@@ -538,10 +976,8 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
 
 
         //Receiving ACK 
-        //Find server's address
-        socklen_t addrlen = sizeof(*(socket->server_ip));
 
-        if(recvfrom(socket->sd,socket->recvbuf,sizeof(microtcp_header_t),0,(struct sockaddr *)socket->server_ip, &addrlen) == -1){ //SYN
+        if(our_recvfrom(socket, socket->recvbuf, sizeof(microtcp_header_t), NULL) == -1){ //SYN
             perror("(!) COULD NOT RECEIVE PACKET!\n");
             exit(EXIT_FAILURE);
         }
@@ -579,7 +1015,7 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
         
         
         //Receiving FIN_ACK 
-        if(recvfrom(socket->sd,socket->recvbuf,sizeof(microtcp_header_t),0,(struct sockaddr *)socket->server_ip, &addrlen) == -1){ //SYN
+        if(our_recvfrom(socket, socket->recvbuf, sizeof(microtcp_header_t), NULL) == -1){ //SYN
             perror("(!) COULD NOT RECEIVE PACKET!\n");
             exit(EXIT_FAILURE);
         }
@@ -623,7 +1059,7 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
         header->data_len = 0;
         header->ack_number = server_seq_num + 1;
         header->seq_number = socket->seq_number + 1;
-        header->future_use0 = 0;
+        header->future_use0 = conn_id_opt(socket);
         header->future_use1 = 0;
         header->future_use2 = 0;
         header->window = socket->curr_win_size; //NOT SURE
@@ -638,7 +1074,7 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
         memcpy(socket->sendbuf, header, sizeof(microtcp_header_t));
     
         //Sending SYN_ACK 
-        if(sendto(socket->sd, socket->sendbuf, sizeof(microtcp_header_t), 0, (struct sockaddr *)socket->server_ip, sizeof(*(socket->server_ip))) == -1){
+        if(our_sendto(socket, socket->sendbuf, sizeof(microtcp_header_t), 0, 0, 0) == -1){
             perror("(!) COULD NOT SEND ACK PACKET!\n");
             exit(EXIT_FAILURE);
         }
@@ -647,410 +1083,3643 @@ int microtcp_shutdown (microtcp_sock_t *socket, int how){
 
     free(socket->recvbuf);
     free(socket->sendbuf);
+    free(socket->stash);
+    socket->stash = NULL;
+    socket->stash_len = 0;
+    free(socket->cork_buf);
+    socket->cork_buf = NULL;
+    free(socket->snd.buf);
+    free(socket->snd.segments);
+    memset(&socket->snd, 0, sizeof(microtcp_sndq_t));
+    free(socket->rcv_leftover);
+    socket->rcv_leftover = NULL;
+    socket->rcv_leftover_len = 0;
+    uring_close(socket->uring);
+    socket->uring = NULL;
+    if(socket->listener != NULL) listener_remove(socket);
     free(header);
 }
 
-ssize_t microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length, int flags){
-    size_t remaining = 0, bytes_to_send = 0, data_sent = 0, buffer_offset = 0, retransmit_length;
-    int chunks = 0, result = 0, check_split = 0, retransmit_package = 0;
-    int *array_of_seq = NULL;
-
-    printf("1length: %d\n",length);
-    remaining = length;
-    while(data_sent < length){
-        printf("in while\n");
-        printf("2length: %d\n",length);
-        printf("socket->curr_win_size: %d\n",socket->curr_win_size );
-        printf("socket->cwnd: %d\n",socket->cwnd );
-        printf("remaining: %d\n",remaining);
-        bytes_to_send = min_for3(socket->curr_win_size , socket->cwnd ,remaining);
-        chunks = bytes_to_send / MICROTCP_MSS;
-
-        if(bytes_to_send % MICROTCP_MSS){
-            array_of_seq = malloc((chunks + 1) * sizeof(int));
-        }else{
-            array_of_seq = malloc(chunks * sizeof(int));
-        }
-
-        printf("chunks before sent: %d\n", chunks);
-        for(int i = 0; i < chunks; i++){
-            printf("in for\n");
-            array_of_seq[i] = socket->seq_number - socket->relative_seq_number;
-            result = our_send(socket, buffer + buffer_offset, MICROTCP_MSS, flags);
-            buffer_offset += MICROTCP_MSS;
-            // if(result == -1) return -1;         //check later to retrasmit the pakage
-        }
-
-        /* Check if there is a semi - filled chunk*/
-        if(bytes_to_send % MICROTCP_MSS){
-            array_of_seq[chunks] = socket->seq_number - socket->relative_seq_number;
-            result = our_send(socket, buffer + buffer_offset, bytes_to_send % MICROTCP_MSS, flags);
-            buffer_offset += (bytes_to_send % MICROTCP_MSS);
-            // if(result == -1) return -1;         //check later to retrasmit the pakage
-            chunks++;
-            check_split = 1;
-        }
-
-        /* Get the ACKs */
-        for(int i = 0; i < chunks; i++){ 
-            printf("\n\nseq num:%d\n\n",array_of_seq[i]);
-            printf("in for receive\n");
-            result = our_receive(socket, flags);
-
-            //Package received correctly
-            if(result == 0){
-                socket->packets_send++;
-                socket->cwnd += MICROTCP_MSS;
-            }
-            //If we got 1 dup ack save the package number
-            else if(result == 1){
-                buffer_offset = array_of_seq[i-1]; 
-                retransmit_length = array_of_seq[i] - array_of_seq[i-1];
-            }
-            //If we got 3 dup acks save the package number
-            else if(result == 3){
-                socket->ssthresh = socket->cwnd / 2;
-                socket->cwnd = socket->ssthresh + 1;
-                retransmit_package = 1; //true
-
-                // buffer_offset = array_of_seq[i-3]; //change buffer_offset to the position of the package we have to retransmit
-                // retransmit_length = array_of_seq[i-2] - array_of_seq[i-3];
+/* Wrap-around safe comparison of 32-bit sequence numbers and timestamps */
+static int seq_before(uint32_t a, uint32_t b){
+    return (int32_t)(a - b) < 0;
+}
 
-            }//if timeout occured
-            else if(result == -2){
-                socket->ssthresh = socket->cwnd / 2;
-                socket->cwnd = min(MICROTCP_MSS , socket->ssthresh);
-                retransmit_package = 1; //true
-            }
-            // if(result == -1) return -1;
-        }
+/*
+ * RACK loss detection. A segment that was sent before the most recently
+ * delivered one is considered lost once a reordering window has passed
+ * on top of the RTT of the delivered segment.
+ *
+ * Returns the index of the first lost segment, or next if none is lost yet.
+ * If a segment may still be just reordered, *reo_timeout is set to the time
+ * left until it can be marked lost.
+ */
+static size_t rack_detect_loss(microtcp_sock_t *socket, microtcp_segment_t *segments, size_t una, size_t next, uint32_t now, uint32_t *reo_timeout){
+    uint32_t reo_wnd = socket->min_rtt_us / 4, elapsed = 0;
 
-        if(bytes_to_send == 0){
-            // srand(time(NULL));   // Initialization, should only be called once.
-            // int random = rand() % MICROTCP_ACK_TIMEOUT_US+1;  
-            // wait(&random);
-            result = our_send(socket, NULL, 0, flags);
-            if(result == -1){
-                printf("(!) Error sending empty packet!\n");
-                exit(EXIT_FAILURE);
-            }   
-            result = our_receive(socket, flags);
-            if(result == -1){
-                printf("(!) Error receiving empty packet!\n");
-                exit(EXIT_FAILURE);
-            }
-        }
-        
-        /* Retransmissions */
-        if(retransmit_package == 1){
-            printf("We have to retransmit!\n\n");
-            
-            //send the package with size of the package we have to retrasmit
-            our_send(socket, buffer + buffer_offset, retransmit_length, flags);
-            retransmit_package = 0;
-            retransmit_length = 0;
-        }
+    *reo_timeout = 0;
+    if(socket->rack_xmit_ts == 0) return next;
 
-        /* Update congestion control */
-        free(array_of_seq);
-        remaining -= bytes_to_send;
-        data_sent += bytes_to_send;
-        check_split = 0;
-    }
+    for(size_t i = una; i < next; i++){
+        if(!seq_before(segments[i].xmit_ts, socket->rack_xmit_ts)) continue;
 
-    // if(length > MICROTCP_MSS) length = length - (length - MICROTCP_MSS);
-    // if((length + sizeof(microtcp_header_t)) > socket->curr_win_size) length = socket->curr_win_size - sizeof(microtcp_header_t);
-    // if(length <= 0) while(wait_until_space_available(length) != 0);
+        elapsed = now - segments[i].xmit_ts;
+        if(elapsed >= socket->rack_rtt_us + reo_wnd) return i;
 
-    return length;
+        *reo_timeout = socket->rack_rtt_us + reo_wnd - elapsed;
+        break;
+    }
+    return next;
 }
 
-ssize_t microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags){
-    microtcp_header_t *recv_header = malloc(sizeof(microtcp_header_t));
-    microtcp_header_t *ack_header = malloc(sizeof(microtcp_header_t));
-    size_t packet_size = sizeof(microtcp_header_t) + length, data_received = 0;
-    uint32_t retrieved_checksum = 0, checksum_num = 0;
+/*
+ * Remember the congestion state before the first retransmission of a loss
+ * episode, so that it can be restored if the retransmission proves spurious.
+ */
+static void save_undo_state(microtcp_sock_t *socket){
+    if(socket->undo_ts != 0) return;
 
-    socket->sendbuf = malloc(sizeof(microtcp_header_t));
-    memset(buffer, 0, length);
+    socket->prior_cwnd = socket->cwnd;
+    socket->prior_ssthresh = socket->ssthresh;
+    socket->undo_ts = microtcp_ts_now();
+}
 
-    if(socket->sendbuf == NULL){
-        printf("(!) Memory allocation failed!\n");
-        exit(EXIT_FAILURE);
+/*
+ * HyStart: leave slow start before it overshoots, when the ACKs of a round
+ * keep arriving back-to-back for half the minimum RTT (the pipe is full), or
+ * when the RTT of this round has grown over the previous one (a queue is
+ * building). It only sets ssthresh, so it does not depend on how cwnd grows.
+ */
+static void hystart_update(microtcp_sock_t *socket, uint32_t now){
+    uint32_t rtt = 0, eta = 0;
+
+    if(!socket->hystart_enabled || socket->cwnd >= socket->ssthresh) return;
+
+    /* A new round starts once everything sent in the previous one is ACKed */
+    if(socket->hystart_round_start == 0 || !seq_before(socket->last_ack_number, socket->hystart_round_end)){
+        socket->hystart_round_end = socket->seq_number;
+        socket->hystart_round_start = now;
+        socket->hystart_last_ack = now;
+        socket->hystart_last_rtt_us = socket->hystart_curr_rtt_us;
+        socket->hystart_curr_rtt_us = 0;
+        socket->hystart_samples = 0;
     }
-    if(recv_header == NULL){
-        printf("(!) Memory allocation failed!\n");
-        exit(EXIT_FAILURE);
+    if(socket->cwnd < MICROTCP_HYSTART_LOW_WINDOW) return;
+
+    /* ACK train, broken as soon as two ACKs are too far apart */
+    if(now - socket->hystart_last_ack <= MICROTCP_HYSTART_ACK_DELTA_US){
+        socket->hystart_last_ack = now;
+        if(socket->min_rtt_us != 0 && now - socket->hystart_round_start >= socket->min_rtt_us / 2){
+            printf("HyStart: ACK train, leaving slow start at cwnd %zu\n", socket->cwnd);
+            socket->ssthresh = socket->cwnd;
+            return;
+        }
     }
-    if(ack_header == NULL){
-        printf("(!) Memory allocation failed!\n");
-        exit(EXIT_FAILURE);
+
+    /* Delay increase, based on the minimum of the first RTT samples of the round */
+    if(socket->ts_echo != 0 && socket->hystart_samples < MICROTCP_HYSTART_MIN_SAMPLES){
+        rtt = now - socket->ts_echo;
+        if(socket->hystart_curr_rtt_us == 0 || rtt < socket->hystart_curr_rtt_us) socket->hystart_curr_rtt_us = rtt;
+        socket->hystart_samples++;
+
+        if(socket->hystart_samples == MICROTCP_HYSTART_MIN_SAMPLES && socket->hystart_last_rtt_us != 0){
+            eta = min(max(socket->hystart_last_rtt_us / 8, MICROTCP_HYSTART_DELAY_MIN_US), MICROTCP_HYSTART_DELAY_MAX_US);
+            if(socket->hystart_curr_rtt_us >= socket->hystart_last_rtt_us + eta){
+                printf("HyStart: delay increase, leaving slow start at cwnd %zu\n", socket->cwnd);
+                socket->ssthresh = socket->cwnd;
+            }
+        }
     }
+}
 
-    socklen_t addrlen = sizeof(*(socket->client_ip));
+/*
+ * Token bucket rate limit. Takes the tokens for a datagram of packet_size
+ * bytes and returns 1, or returns 0 and sets *wait_us to the time until
+ * there are enough of them. With force set the tokens are always taken,
+ * even if the bucket goes into debt.
+ */
+static int token_bucket_take(microtcp_sock_t *socket, size_t packet_size, int force, uint32_t *wait_us){
+    uint64_t now = 0;
 
-    //initalize so it goes in while
-    recv_header->data_len = MICROTCP_MSS;
-    while(1){
-        /*Server receives a package!*/
-        if(socket->server_ip == NULL){
-            if(recvfrom(socket->sd, socket->recvbuf, packet_size, 0, (struct sockaddr *)socket->client_ip, &addrlen) == -1){ //SYN
-                perror("(!) COULD NOT RECEIVE PACKET!\n");
-                return -1;
-            }
-            else printf("RECEIVED PACKAGE YAY!\n");
-            
-        }/*Client receive a package*/
-        else{
-            if(recvfrom(socket->sd, socket->recvbuf, packet_size, 0, socket->server_ip, &addrlen) == -1){ //SYN
-                perror("(!) COULD NOT RECEIVE PACKET!\n");
+    *wait_us = 0;
+    if(socket->tb_rate == 0) return 1;
+
+    now = now_ns();
+    socket->tb_tokens += (now - socket->tb_last_ns) * socket->tb_rate / 1000000000;
+    if(socket->tb_tokens > (int64_t)socket->tb_burst) socket->tb_tokens = socket->tb_burst;
+    socket->tb_last_ns = now;
+
+    if(!force && socket->tb_tokens < (int64_t)packet_size){
+        *wait_us = (packet_size - socket->tb_tokens) * 1000000 / socket->tb_rate + 1;
+        return 0;
+    }
+    socket->tb_tokens -= packet_size;
+    return 1;
+}
+
+/*
+ * Tail loss probe timeout, 2*SRTT, plus the delayed ACK timer of the peer
+ * when a single segment is in flight. Returns 0 if there is no RTT sample yet
+ */
+static uint32_t tlp_timeout(microtcp_sock_t *socket, size_t segs_inflight){
+    uint32_t pto = 2 * socket->srtt_us;
+
+    if(socket->srtt_us == 0) return 0;
+    if(segs_inflight == 1) pto += MICROTCP_DELACK_TIMEOUT_US;
+    if(pto < MICROTCP_TLP_MIN_PTO_US) pto = MICROTCP_TLP_MIN_PTO_US;
+    return pto;
+}
+
+/* Whether a segment can be read without blocking */
+static int rcv_ready(microtcp_sock_t *socket){
+    int queued = 0;
+
+    if(socket->stash_len != 0) return 1;
+    if(socket->uring != NULL) return uring_rx_ready(socket);
+    if(ioctl(socket->rx_sd, FIONREAD, &queued) == -1) return 0;
+    return queued > 0;
+}
+
+/* Segment size we fall back to, the one every path is assumed to carry */
+static uint32_t base_mss(microtcp_sock_t *socket){
+    return min(MICROTCP_MSS, min(socket->local_mss, socket->peer_mss));
+}
+
+/*
+ * PLPMTUD (RFC 8899). Returns the size of the probe to send, or 0 if no probe
+ * is due. The largest size both ends accept is tried first, it is what jumbo
+ * paths carry, and the search bisects between the current size and the
+ * smallest size that was lost from there on.
+ */
+static uint32_t plpmtud_probe_size(microtcp_sock_t *socket){
+    uint32_t largest = min(socket->local_mss, socket->peer_mss);
+
+    if(!socket->plpmtud || socket->plpmtud_inflight) return 0;
+    if(socket->plpmtud_probe != 0) return socket->plpmtud_probe;
+
+    if(socket->plpmtud_high < socket->mss + MICROTCP_PLPMTUD_MIN_STEP){
+        //The search is over, the path may carry larger segments again later
+        if(microtcp_ts_now() - socket->plpmtud_raise_ts < MICROTCP_PLPMTUD_RAISE_US) return 0;
+        socket->plpmtud_high = largest;
+        socket->plpmtud_raise_ts = microtcp_ts_now();
+        if(socket->plpmtud_high < socket->mss + MICROTCP_PLPMTUD_MIN_STEP) return 0;
+    }
+    if(socket->plpmtud_high == largest) socket->plpmtud_probe = largest;
+    else socket->plpmtud_probe = socket->mss + (socket->plpmtud_high - socket->mss) / 2;
+    return socket->plpmtud_probe;
+}
+
+/* Segments of len bytes don't get through, don't send or probe that size again */
+static void plpmtud_lower(microtcp_sock_t *socket, uint32_t len){
+    printf("PLPMTUD: segments of %u bytes don't get through\n", len);
+    socket->plpmtud_high = max(len - 1, base_mss(socket));
+    if(socket->mss >= len) socket->mss = base_mss(socket);
+    socket->plpmtud_probe = 0;
+    socket->plpmtud_inflight = 0;
+    socket->plpmtud_fails = 0;
+    socket->plpmtud_raise_ts = microtcp_ts_now();
+}
+
+/* The probe got lost, try that size a few times before giving it up */
+static void plpmtud_probe_lost(microtcp_sock_t *socket){
+    socket->plpmtud_inflight = 0;
+    if(++socket->plpmtud_fails >= MICROTCP_PLPMTUD_MAX_PROBES) plpmtud_lower(socket, socket->plpmtud_probe);
+}
+
+/* The probe got through, the path carries segments of that size */
+static void plpmtud_probe_acked(microtcp_sock_t *socket){
+    printf("PLPMTUD: segment size raised to %u\n", socket->plpmtud_probe);
+    socket->mss = socket->plpmtud_probe;
+    if(socket->cwnd < socket->mss) socket->cwnd = socket->mss;     //Room for at least one segment
+    socket->plpmtud_probe = 0;
+    socket->plpmtud_inflight = 0;
+    socket->plpmtud_fails = 0;
+    socket->plpmtud_raise_ts = microtcp_ts_now();
+}
+
+/*
+ * Going back to resend from segment first. Segments are cut again from there
+ * if a probe is among them or they are larger than the segment size now is.
+ * Returns the new number of segments cut so far.
+ */
+static size_t resegment(microtcp_sock_t *socket, microtcp_segment_t *segments, size_t first, size_t built, size_t *built_len){
+    for(size_t i = first; i < built; i++){
+        if(segments[i].probe && socket->plpmtud_inflight) plpmtud_probe_lost(socket);
+        if(segments[i].probe || segments[i].length > socket->mss){
+            *built_len = segments[first].offset;
+            return first;
+        }
+    }
+    return built;
+}
+
+/* Bytes at the front of the send buffer that are acknowledged already */
+static size_t snd_acked(microtcp_sndq_t *q){
+    return q->una < q->built ? q->segments[q->una].offset : q->built_len;
+}
+
+/* Whether some of the queued data is not acknowledged yet */
+static int snd_pending(microtcp_sock_t *socket){
+    return socket->snd.una < socket->snd.built || socket->snd.built_len < socket->snd.len;
+}
+
+/* Room left in the send buffer */
+static size_t snd_space(microtcp_sock_t *socket){
+    size_t queued = socket->snd.len - snd_acked(&socket->snd);
+
+    return queued < socket->sndbuf_max ? socket->sndbuf_max - queued : 0;
+}
+
+/*
+ * Makes room for len more bytes at the end of the send buffer, dropping the
+ * data that is acknowledged already from its front.
+ */
+static void snd_reserve(microtcp_sock_t *socket, size_t len){
+    microtcp_sndq_t *q = &socket->snd;
+    size_t acked = snd_acked(q);
+
+    if(q->buf_size - q->len >= len) return;
+    if(acked != 0){
+        memmove(q->buf, q->buf + acked, q->len - acked);
+        for(size_t i = q->una; i < q->built; i++) q->segments[i].offset -= acked;
+        memmove(q->segments, q->segments + q->una, (q->built - q->una) * sizeof(microtcp_segment_t));
+        q->built -= q->una;
+        q->next -= q->una;
+        q->una = 0;
+        q->built_len -= acked;
+        q->len -= acked;
+        q->start_seq += acked;
+    }
+    if(q->buf_size - q->len < len){
+        q->buf_size = max(q->len + len, min(2 * q->buf_size, socket->sndbuf_max));
+        q->buf = realloc(q->buf, q->buf_size);
+        if(q->buf == NULL){
+            printf("(!) Memory allocation failed!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static uint32_t cork_timeout(microtcp_sock_t *socket){
+    return socket->cork || !socket->nagle ? MICROTCP_CORK_TIMEOUT_US : MICROTCP_NAGLE_TIMEOUT_US;
+}
+
+/* Microseconds left of a timer started at start, at least 1 */
+static uint32_t timer_left(uint32_t now, uint32_t start, uint32_t timeout){
+    uint32_t elapsed = now - start;
+
+    return elapsed < timeout ? timeout - elapsed : 1;
+}
+
+/*
+ * Whether the small writes held back have to go: their timer ran out, or
+ * Nagle alone holds them and nothing is in flight any more.
+ */
+static int cork_due(microtcp_sock_t *socket){
+    if(socket->cork_len == 0) return 0;
+    if(microtcp_ts_now() - socket->cork_ts >= cork_timeout(socket)) return 1;
+    return socket->nagle && !socket->cork && !snd_pending(socket);
+}
+
+/* Moves the held back writes into the send buffer once they are due and fit, snd_pump() sends them along */
+static void cork_release(microtcp_sock_t *socket){
+    microtcp_sndq_t *q = &socket->snd;
+
+    if(!cork_due(socket) || socket->cork_len > snd_space(socket)) return;
+    if(q->len == 0) q->start_seq = socket->seq_number;
+    snd_reserve(socket, socket->cork_len);
+    memcpy(q->buf + q->len, socket->cork_buf, socket->cork_len);
+    q->len += socket->cork_len;
+    socket->cork_len = 0;
+}
+
+/*
+ * Sends what the congestion window, the peer's window and the rate limit
+ * allow, takes in the ACKs and retransmits what got lost. It waits for ACKs
+ * only until space bytes of the send buffer are free: with 0 it never waits,
+ * with SIZE_MAX it returns once all of the data is acknowledged.
+ */
+static int snd_pump(microtcp_sock_t *socket, int flags, size_t space){
+    microtcp_sndq_t *q = &socket->snd;
+    size_t lost = 0, inflight = 0, next_len = 0, acked = 0;
+    uint32_t probe = 0, now = 0, timeout = 0, elapsed = 0, pto = 0, reo_timeout = 0, token_wait = 0;
+    int result = 0;
+    enum { TIMER_RTO, TIMER_REO, TIMER_TLP, TIMER_TOKEN, TIMER_CORK } timer = TIMER_RTO;
+
+    /* Segments are cut as they are first sent, so that a new segment size
+     * applies right away. What was held back joins them once it is due */
+    for(cork_release(socket); q->una < q->built || q->built_len < q->len; cork_release(socket)){
+        /* Send as much as the congestion window, the peer's window and the rate limit allow,
+         * with io_uring in one submission */
+        token_wait = 0;
+        uring_batch(socket, 1);
+        while(q->next < q->built || q->built_len < q->len){
+            if(q->next == q->built){
+                if(q->built == q->nsegs){
+                    q->nsegs = max(2 * q->nsegs, 64);
+                    q->segments = realloc(q->segments, q->nsegs * sizeof(microtcp_segment_t));
+                    if(q->segments == NULL){
+                        printf("(!) Memory allocation failed!\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                q->segments[q->built].offset = q->built_len;
+                q->segments[q->built].seq_number = q->start_seq + q->built_len;
+                q->segments[q->built].length = min(socket->mss, q->len - q->built_len);
+                q->segments[q->built].xmit_ts = 0;
+                q->segments[q->built].retransmitted = 0;
+                q->segments[q->built].probe = 0;
+                /* PLPMTUD probe, padded up to its size if we don't have that much data.
+                 * It waits for the windows to have room for all of it */
+                inflight = q->una < q->built ? q->built_len - q->segments[q->una].offset : 0;
+                probe = q->in_recovery ? 0 : plpmtud_probe_size(socket);
+                if(probe != 0 && inflight + probe <= min(socket->cwnd, socket->curr_win_size)){
+                    q->segments[q->built].length = min(probe, q->len - q->built_len);
+                    q->segments[q->built].probe = 1;
+                }
+                q->built_len += q->segments[q->built].length;
+                q->built++;
+            }
+            inflight = q->segments[q->next].seq_number - q->segments[q->una].seq_number;
+            if(inflight + q->segments[q->next].length > min(socket->cwnd, socket->curr_win_size)) break;
+            if(!token_bucket_take(socket, sizeof(microtcp_header_t) + q->segments[q->next].length, 0, &token_wait)) break;
+
+            /* Don't let the peer delay the ACK of the last segment we can send before waiting for one */
+            next_len = q->next + 1 < q->built ? q->segments[q->next + 1].length : min(socket->mss, q->len - q->built_len);
+            if(next_len == 0 || inflight + q->segments[q->next].length + next_len > min(socket->cwnd, socket->curr_win_size) || q->segments[q->next].probe)
+                socket->ack_now_pending = 1;
+            if(q->segments[q->next].probe && !socket->plpmtud_inflight){
+                socket->xmit_pad = socket->plpmtud_probe;
+                socket->plpmtud_inflight = 1;
+                socket->plpmtud_probes++;
+            }
+            if(our_send_seq(socket, q->segments[q->next].seq_number, (const uint8_t *)q->buf + q->segments[q->next].offset, q->segments[q->next].length, flags) == -1){
+                /* Too large for the interface, cut it down and go on */
+                if(errno == EMSGSIZE && (q->segments[q->next].probe || q->segments[q->next].length > base_mss(socket))){
+                    plpmtud_lower(socket, q->segments[q->next].probe ? socket->plpmtud_probe : q->segments[q->next].length);
+                    q->built = resegment(socket, q->segments, q->next, q->built, &q->built_len);
+                    continue;
+                }
+                uring_batch(socket, 0);
                 return -1;
             }
-            else printf("RECEIVED PACKAGE YAY!\n");
+            if(q->segments[q->next].xmit_ts != 0) q->segments[q->next].retransmitted = 1;
+            q->segments[q->next].xmit_ts = socket->last_xmit_ts;
+            if(q->una == q->next) q->rto_start = socket->last_xmit_ts;
+            if(seq_before(socket->seq_number, q->segments[q->next].seq_number + q->segments[q->next].length))
+                socket->seq_number = q->segments[q->next].seq_number + q->segments[q->next].length;
+            q->next++;
+        }
+        uring_batch(socket, 0);
+
+        /* Peer's window is closed. Probe it when the persist timer runs out,
+         * doubling the timer for as long as the window stays closed. ACKs in
+         * between only tell us whether it opened, they don't trigger probes */
+        if(q->una == q->next && token_wait == 0){
+            now = microtcp_ts_now();
+            if(q->persist_us == 0 || !seq_before(now, q->persist_deadline)){
+                if(q->persist_us == 0) q->persist_us = socket->rto_us;
+                else q->persist_us = min(2 * (uint64_t)q->persist_us, MICROTCP_MAX_PERSIST_US);
+                printf("Peer's window is closed, probing it!\n\n");
+                socket->ack_now_pending = 1;
+                if(our_send_seq(socket, q->segments[q->una].seq_number, NULL, 0, flags) == -1){
+                    printf("(!) Error sending empty packet!\n");
+                    exit(EXIT_FAILURE);
+                }
+                socket->window_probes++;
+                q->persist_deadline = now + q->persist_us;
+            }
+            if(snd_space(socket) >= space && (socket->stash_len != 0 || !rcv_ready(socket))) return 0;
+            our_receive(socket, flags, seq_before(now, q->persist_deadline) ? q->persist_deadline - now : 1);
+            socket->duplicate_ack_count = 0;    //Answers to probes, not a sign of loss
+            continue;
+        }
+        q->persist_us = 0;
+
+        /* Wait for the earliest of the RTO, the RACK reordering timer, the TLP
+         * and the rate limiter having enough tokens for the next segment */
+        now = microtcp_ts_now();
+        elapsed = now - q->rto_start;
+        timeout = elapsed < socket->rto_us ? socket->rto_us - elapsed : 1;
+        timer = TIMER_RTO;
+        if(token_wait != 0 && (q->una == q->next || token_wait < timeout)){
+            timeout = token_wait;
+            timer = TIMER_TOKEN;
+        }
+        if(q->reo_armed){
+            elapsed = seq_before(now, q->reo_deadline) ? q->reo_deadline - now : 1;
+            if(elapsed < timeout){
+                timeout = elapsed;
+                timer = TIMER_REO;
+            }
+        }
+        if(socket->cork_len != 0 && (elapsed = timer_left(now, socket->cork_ts, cork_timeout(socket))) < timeout){
+            timeout = elapsed;
+            timer = TIMER_CORK;
+        }
+        pto = tlp_timeout(socket, q->next - q->una);
+        if(q->next == q->built && q->built_len == q->len && !q->tlp_sent && pto != 0){
+            elapsed = now - socket->last_xmit_ts;
+            elapsed = elapsed < pto ? pto - elapsed : 1;
+            if(elapsed < timeout){
+                timeout = elapsed;
+                timer = TIMER_TLP;
+            }
+        }
+
+        /* With enough room in the send buffer, take only the ACKs that are
+         * there already and the timers that ran out. A segment kept for
+         * microtcp_recv() has to be taken first, or the next one is lost */
+        if(snd_space(socket) >= space && (socket->stash_len != 0 || !rcv_ready(socket))){
+            if(timeout > 1) return 0;
+            result = -2;
+        }
+        else result = our_receive(socket, flags, timeout);
+        now = microtcp_ts_now();
+        lost = q->next;
+
+        if(result == -2){
+            if(timer == TIMER_TOKEN){
+                token_wait = 0;
+                continue;
+            }
+            else if(timer == TIMER_CORK) continue;
+            else if(timer == TIMER_TLP && q->segments[q->next - 1].probe){
+                /* A PLPMTUD probe at the tail, resending it as is would not help */
+                lost = q->next - 1;
+            }
+            else if(timer == TIMER_TLP){
+                /* Tail loss probe: resend the last segment to trigger an ACK */
+                printf("Sending tail loss probe!\n\n");
+                token_bucket_take(socket, sizeof(microtcp_header_t) + q->segments[q->next - 1].length, 1, &token_wait);
+                socket->ack_now_pending = 1;
+                our_send_seq(socket, q->segments[q->next - 1].seq_number, (const uint8_t *)q->buf + q->segments[q->next - 1].offset, q->segments[q->next - 1].length, flags);
+                q->segments[q->next - 1].xmit_ts = socket->last_xmit_ts;
+                q->segments[q->next - 1].retransmitted = 1;
+                q->tlp_sent = 1;
+                continue;
+            }
+            else if(timer == TIMER_REO){
+                q->reo_armed = 0;
+                lost = rack_detect_loss(socket, q->segments, q->una, q->next, now, &reo_timeout);
+            }
+            else{
+                /* Retransmission timeout, go back to the first unacknowledged segment */
+                printf("We have to retransmit!\n\n");
+                save_undo_state(socket);
+                socket->ssthresh = socket->cwnd / 2;
+                if(socket->ssthresh < 2 * socket->mss) socket->ssthresh = 2 * socket->mss;
+                socket->cwnd = socket->mss;
+                socket->rto_us = min(2 * (uint64_t)socket->rto_us, MICROTCP_MAX_RTO_US);
+                socket->packets_lost++;
+                socket->bytes_lost += q->segments[q->una].length;
+                /* Nothing gets through at all, the path may have become a black hole for our segment size */
+                if(++socket->plpmtud_rtos >= 2 && socket->plpmtud && socket->mss > base_mss(socket)) plpmtud_lower(socket, socket->mss);
+                q->built = resegment(socket, q->segments, q->una, q->built, &q->built_len);
+                q->next = q->una;
+                q->in_recovery = 0;
+                q->reo_armed = 0;
+                q->tlp_sent = 0;
+                q->rto_start = now;
+                continue;
+            }
+        }
+        else if(result >= 0){
+            /* Release everything that has been cumulatively acknowledged */
+            int advanced = 0;
+            while(q->una < q->built && !seq_before(socket->last_ack_number, q->segments[q->una].seq_number + q->segments[q->una].length)){
+                socket->packets_send++;
+                socket->bytes_send += q->segments[q->una].length;
+                if(!q->in_recovery){
+                    if(socket->cwnd < socket->ssthresh) socket->cwnd += q->segments[q->una].length;
+                    else socket->cwnd += socket->mss * q->segments[q->una].length / socket->cwnd;
+                }
+                if(q->segments[q->una].probe && socket->plpmtud_inflight) plpmtud_probe_acked(socket);
+                q->una++;
+                advanced = 1;
+                socket->plpmtud_rtos = 0;
+            }
+            if(q->next < q->una) q->next = q->una;
+            /* The peer has the front of the segment, from a send cut differently
+             * before it was resegmented. Only the rest is resent, the peer would
+             * drop a segment that starts before what it expects */
+            if(q->una < q->built && seq_before(q->segments[q->una].seq_number, socket->last_ack_number)){
+                acked = socket->last_ack_number - q->segments[q->una].seq_number;
+                q->segments[q->una].offset += acked;
+                q->segments[q->una].seq_number += acked;
+                q->segments[q->una].length -= acked;
+            }
+            if(advanced && !q->in_recovery) hystart_update(socket, now);
+            if(advanced){
+                q->rto_start = now;
+                q->tlp_sent = 0;
+                q->reo_armed = 0;
+                if(socket->srtt_us != 0)
+                    socket->rto_us = min(max(socket->srtt_us + 4 * socket->rttvar_us, MICROTCP_MIN_RTO_US), MICROTCP_MAX_RTO_US);
+                if(q->in_recovery && !seq_before(socket->last_ack_number, q->recovery_seq)) q->in_recovery = 0;
+
+                /* Eifel detection: if the first ACK after a retransmission echoes a
+                 * timestamp older than it, the original transmission got through */
+                if(socket->undo_ts != 0){
+                    if(socket->ts_echo != 0 && seq_before(socket->ts_echo, socket->undo_ts)){
+                        printf("Spurious retransmission, restoring cwnd and ssthresh!\n\n");
+                        socket->cwnd = max(socket->cwnd, socket->prior_cwnd);
+                        socket->ssthresh = max(socket->ssthresh, socket->prior_ssthresh);
+                        socket->spurious_retransmits++;
+                        q->in_recovery = 0;
+                    }
+                    socket->undo_ts = 0;
+                }
+            }
+
+            /* ECN: the receiver saw a CE mark, back off once per window without waiting for a loss */
+            if(socket->ecn_echo){
+                socket->ecn_echo = 0;
+                if(!q->in_recovery && !socket->ecn_cwr_pending && !seq_before(socket->last_ack_number, socket->ecn_cwr_seq)){
+                    printf("ECN echo, reducing cwnd!\n\n");
+                    socket->ssthresh = socket->cwnd / 2;
+                    if(socket->ssthresh < 2 * socket->mss) socket->ssthresh = 2 * socket->mss;
+                    socket->cwnd = socket->ssthresh;
+                    socket->ecn_cwr_seq = socket->seq_number;
+                    socket->ecn_cwr_pending = 1;
+                }
+            }
+            if(q->una == q->built && q->built_len == q->len) break;
+
+            if(result == 3 && !q->in_recovery) lost = q->una;
+            else lost = rack_detect_loss(socket, q->segments, q->una, q->next, now, &reo_timeout);
+            if(lost == q->next && reo_timeout != 0){
+                q->reo_armed = 1;
+                q->reo_deadline = now + reo_timeout;
+            }
+        }
+
+        /* Fast retransmit, resend everything from the lost segment on. A lost
+         * PLPMTUD probe says the segment was too large, not that there is congestion */
+        if(lost < q->next){
+            printf("We have to retransmit!\n\n");
+            if(!q->in_recovery && !q->segments[lost].probe){
+                save_undo_state(socket);
+                socket->ssthresh = socket->cwnd / 2;
+                if(socket->ssthresh < 2 * socket->mss) socket->ssthresh = 2 * socket->mss;
+                socket->cwnd = socket->ssthresh;
+                q->recovery_seq = q->segments[q->next - 1].seq_number + q->segments[q->next - 1].length;
+                q->in_recovery = 1;
+            }
+            socket->packets_lost++;
+            socket->bytes_lost += q->segments[lost].length;
+            q->built = resegment(socket, q->segments, lost, q->built, &q->built_len);
+            q->next = lost;
+            q->reo_armed = 0;
+        }
+    }
+
+    return 0;
+}
+
+/* Copies the data into the send buffer and sends what the windows allow, waiting only while the buffer is full */
+static ssize_t snd_enqueue(microtcp_sock_t *socket, const void *buffer, size_t length, int flags){
+    microtcp_sndq_t *q = &socket->snd;
+    size_t done = 0, chunk = 0;
+
+    while(done < length){
+        chunk = min(length - done, snd_space(socket));
+        if(chunk == 0){
+            if(snd_pump(socket, flags, min(socket->sndlowat, length - done)) == -1) return -1;
+            continue;
+        }
+        if(q->len == 0) q->start_seq = socket->seq_number;
+        snd_reserve(socket, chunk);
+        memcpy(q->buf + q->len, (const uint8_t *)buffer + done, chunk);
+        q->len += chunk;
+        done += chunk;
+        if(snd_pump(socket, flags, 0) == -1) return -1;
+    }
+    return length;
+}
+
+/* Sends the small writes that were held back */
+static ssize_t cork_flush(microtcp_sock_t *socket, int flags){
+    size_t len = socket->cork_len;
+
+    socket->cork_len = 0;
+    if(len == 0) return 0;
+    return snd_enqueue(socket, socket->cork_buf, len, flags);
+}
+
+/* Sends everything held back or queued and waits until the peer acknowledged all of it */
+static int snd_flush(microtcp_sock_t *socket, int flags){
+    if(cork_flush(socket, flags) == -1) return -1;
+    return snd_pump(socket, flags, SIZE_MAX);
+}
+
+ssize_t microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length, int flags){
+    int nonblock = socket->nonblock || (flags & MSG_DONTWAIT);
+    //Nagle coalesces only while data is in flight, its ACK sends what was held back
+    int hold = socket->cork || (flags & MSG_MORE) || (socket->nagle && snd_pending(socket));
+    size_t take = 0, direct = 0, room = 0;
+
+    if(socket->engine != NULL) return engine_send(socket, buffer, length);
+
+    flags &= ~(MSG_MORE | MSG_DONTWAIT);     //Ours, with MSG_MORE the kernel would merge our datagrams
+    //Take only what fits next to the data held back, snd_enqueue() never has to wait for room then
+    if(nonblock && length != 0){
+        if(snd_pump(socket, flags, 0) == -1) return -1;
+        room = snd_space(socket) > socket->cork_len ? snd_space(socket) - socket->cork_len : 0;
+        if(room == 0){
+            errno = EAGAIN;
+            return -1;
+        }
+        length = min(length, room);
+    }
+    if(!hold && socket->cork_len == 0) return snd_enqueue(socket, buffer, length, flags);
+
+    //Held back for too long already
+    if(socket->cork_len != 0 && microtcp_ts_now() - socket->cork_ts >= cork_timeout(socket) && cork_flush(socket, flags) == -1) return -1;
+
+    //Top up the held segment first, it goes out once it is full
+    if(socket->cork_len >= socket->mss && cork_flush(socket, flags) == -1) return -1;
+    if(socket->cork_len != 0){
+        take = min(length, socket->mss - socket->cork_len);
+        memcpy(socket->cork_buf + socket->cork_len, buffer, take);
+        socket->cork_len += take;
+        if((socket->cork_len == socket->mss || !hold) && cork_flush(socket, flags) == -1) return -1;
+    }
+
+    //Full segments go straight from the user's buffer, a short tail is held back
+    direct = length - take;
+    if(hold) direct -= direct % socket->mss;
+    if(direct != 0 && snd_enqueue(socket, (const uint8_t *)buffer + take, direct, flags) == -1) return -1;
+    take += direct;
+
+    if(take < length){
+        if(socket->cork_buf == NULL && (socket->cork_buf = malloc(MICROTCP_MAX_MSS)) == NULL){
+            printf("(!) Memory allocation failed!\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(socket->cork_buf, (const uint8_t *)buffer + take, length - take);
+        socket->cork_len = length - take;
+        socket->cork_ts = microtcp_ts_now();
+    }
+
+    return length;
+}
+
+/*
+ * The window we advertise, in bytes. It goes out shifted right by our window
+ * scale, so round it down to what the peer will see, and saturate what the
+ * 16 bits of the header can carry instead of letting it wrap around to 0.
+ */
+static size_t free_window(microtcp_sock_t *socket){
+    size_t wnd = 0, fill = socket->buf_fill_level + engine_rx_queued(socket);
+
+    if(fill < socket->init_win_size) wnd = socket->init_win_size - fill;
+    return min(wnd >> socket->rcv_wscale, UINT16_MAX) << socket->rcv_wscale;
+}
+
+/*
+ * Receiver side silly window avoidance (RFC 1122 4.2.3.3). The window shrinks
+ * as data arrives, but only grows once it opened by a full segment or half the
+ * buffer, whichever is less, so the sender is never invited to send tiny ones.
+ * The segment is the largest the peer sent so far, which a larger MSS raises.
+ */
+static uint16_t rcv_window(microtcp_sock_t *socket){
+    size_t wnd = free_window(socket);
+    size_t threshold = min((size_t)socket->rcv_mss, min(socket->init_win_size, (size_t)UINT16_MAX << socket->rcv_wscale) / 2);
+
+    if(wnd < socket->rcv_wnd_adv || wnd - socket->rcv_wnd_adv >= threshold) socket->rcv_wnd_adv = wnd;
+    return socket->rcv_wnd_adv >> socket->rcv_wscale;
+}
+
+/*
+ * Receive buffer auto-tuning (dynamic right-sizing). The peer echoes the
+ * timestamp of our last ACK in its data, which gives the receiver an RTT.
+ * Spikes from a peer that was idle are smoothed, drops are taken at once.
+ */
+static void rcv_rtt_update(microtcp_sock_t *socket, uint32_t ts_echo){
+    uint32_t rtt_us = microtcp_ts_now() - ts_echo;
+
+    if(ts_echo == 0 || rtt_us > MICROTCP_MAX_RTO_US) return;
+    if(rtt_us == 0) rtt_us = 1;
+    if(socket->rcv_rtt_us == 0 || rtt_us < socket->rcv_rtt_us) socket->rcv_rtt_us = rtt_us;
+    else socket->rcv_rtt_us += (rtt_us - socket->rcv_rtt_us) / 8;
+}
+
+/*
+ * Counts what the application read and once per RTT sizes the buffer at twice
+ * that, up to rcvbuf_max. A sender limited by our window then gets twice the
+ * window the next RTT, as it would in slow start, while a flow on a short path
+ * reads little per RTT and keeps the small buffer it started with.
+ */
+static void rcvbuf_autotune(microtcp_sock_t *socket, size_t copied){
+    uint32_t now = microtcp_ts_now();
+    size_t target = 0;
+
+    socket->rcv_copied += copied;
+    if(socket->rcv_rtt_us == 0 || now - socket->rcv_space_ts < socket->rcv_rtt_us) return;
+
+    target = min(2 * socket->rcv_copied, socket->rcvbuf_max);
+    if(target > socket->init_win_size){
+        target = rcvbuf_resize(socket, target);
+        if(target > socket->init_win_size){
+            printf("Receive buffer grown to %zu bytes\n", target);
+            socket->init_win_size = target;
+        }
+    }
+    socket->rcv_copied = 0;
+    socket->rcv_space_ts = now;
+}
+
+/* Accounts for a read that spun from start to end, hit tells whether it got a datagram */
+static void busy_poll_account(microtcp_sock_t *socket, uint64_t start, uint64_t end, int hit){
+    socket->busy_poll_ns += end - start;
+    if(hit) socket->busy_poll_hits++;
+    else{
+        socket->busy_poll_misses++;
+        socket->busy_poll_wasted_ns += end - start;
+    }
+}
+
+/*
+ * io_uring backend. The ring is set up with the raw system calls, its queues
+ * are shared memory: we write submissions at the SQ tail and take
+ * completions at the CQ head, the kernel does the opposite.
+ *
+ * One multishot recvmsg stays armed on rx_sd, each datagram that arrives
+ * completes it once more, in a buffer the kernel takes from the provided
+ * buffer ring. our_recvfrom() copies the datagram out and gives the buffer
+ * back. Once all buffers are taken the recvmsg ends, it is armed again
+ * when one is free.
+ *
+ * A send copies the datagram into a slot that lives until its completion.
+ * Within a burst of snd_pump() the sends are only queued, the burst is
+ * submitted with one system call when it ends or the ring waits. A send that
+ * fails after it was queued is a lost segment for the sender to recover,
+ * a PLPMTUD probe waits for its result, EMSGSIZE tells it is too large.
+ */
+#define URING_RECV UINT64_MAX         /* user_data of the multishot recvmsg */
+#define URING_CANCEL (UINT64_MAX - 1)
+#define URING_BUF_GROUP 0
+#define URING_BUF_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + CMSG_SPACE(sizeof(int)) + \
+                        1 + sizeof(microtcp_header_t) + MICROTCP_MAX_MSS)
+
+typedef struct
+{
+    uint8_t *buf;                 /* The datagram, NULL while the slot is free */
+    struct sockaddr_storage addr;
+    char control[CMSG_SPACE(sizeof(uint64_t)) + CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    int result;
+    uint8_t sync;                 /* The sender waits for the result */
+} microtcp_uring_slot_t;
+
+struct microtcp_uring
+{
+    int fd;
+    uint8_t *sq_ring;
+    uint8_t *cq_ring;             /* The same mapping as sq_ring, unless the kernel maps them apart */
+    size_t sq_ring_len;
+    size_t cq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;              /* Submissions not handed to the kernel yet */
+    uint8_t batch;                /* snd_pump() is sending a burst */
+
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    uint8_t *bufs;
+    uint16_t br_tail;
+    struct msghdr recv_msg;       /* Room the multishot recvmsg leaves for the address and the control data */
+    uint8_t recv_armed;
+    int recv_error;
+    uint16_t rx[MICROTCP_URING_BUFS];  /* Buffers of the datagrams received, oldest first */
+    unsigned rx_head;
+    unsigned rx_count;
+
+    microtcp_uring_slot_t slots[MICROTCP_URING_ENTRIES];
+    unsigned slots_used;
+    unsigned slot_next;
+};
+
+static void uring_buf_give(struct microtcp_uring *u, uint16_t bid){
+    struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (MICROTCP_URING_BUFS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&u->br->tail, ++u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_unmap(struct microtcp_uring *u){
+    if(u->br != NULL && u->br != MAP_FAILED) munmap(u->br, u->br_len);
+    if(u->sqes != NULL && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_len);
+    if(u->cq_ring != NULL && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_len);
+    if(u->sq_ring != NULL && u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_ring_len);
+    if(u->fd != -1) close(u->fd);
+    free(u->bufs);
+    free(u);
+}
+
+/* Sets up a ring, NULL with errno set if the kernel has no io_uring or lacks what we need of it */
+static struct microtcp_uring *uring_open(void){
+    struct microtcp_uring *u = calloc(1, sizeof(struct microtcp_uring));
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned i = 0;
+    int err = 0;
+
+    if(u == NULL){
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(&p, 0, sizeof(p));
+    if((u->fd = syscall(__NR_io_uring_setup, MICROTCP_URING_ENTRIES, &p)) == -1){
+        err = errno;
+        goto fail;
+    }
+    if(!(p.features & IORING_FEAT_EXT_ARG)){
+        err = ENOSYS;
+        goto fail;
+    }
+    u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) u->sq_ring_len = u->cq_ring_len = max(u->sq_ring_len, u->cq_ring_len);
+    u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if(u->sq_ring == MAP_FAILED){
+        err = errno;
+        goto fail;
+    }
+    u->cq_ring = u->sq_ring;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) &&
+       (u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING)) == MAP_FAILED){
+        err = errno;
+        goto fail;
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED){
+        err = errno;
+        goto fail;
+    }
+    u->sq_head = (unsigned *)(u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(u->sq_ring + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(u->sq_ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *)(u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(u->cq_ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(u->cq_ring + p.cq_off.cqes);
+    //Slot i of the array points at submission i, always
+    for(i = 0; i < p.sq_entries; i++) ((unsigned *)(u->sq_ring + p.sq_off.array))[i] = i;
+
+    //The provided buffers
+    u->br_len = MICROTCP_URING_BUFS * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(u->br == MAP_FAILED || (u->bufs = malloc(MICROTCP_URING_BUFS * URING_BUF_SIZE)) == NULL){
+        err = ENOMEM;
+        goto fail;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = MICROTCP_URING_BUFS;
+    reg.bgid = URING_BUF_GROUP;
+    if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1){
+        err = errno;
+        goto fail;
+    }
+    for(i = 0; i < MICROTCP_URING_BUFS; i++) uring_buf_give(u, i);
+    return u;
+
+fail:
+    uring_unmap(u);
+    errno = err;
+    return NULL;
+}
+
+/*
+ * Submits what is queued and waits for wait completions, for timeout_ns at
+ * most if it is not negative. Fails with ETIME when the time is up.
+ */
+static int uring_enter(struct microtcp_uring *u, unsigned wait, int64_t timeout_ns){
+    struct __kernel_timespec ts = { timeout_ns / 1000000000, timeout_ns % 1000000000 };
+    struct io_uring_getevents_arg arg;
+    unsigned flags = wait != 0 ? IORING_ENTER_GETEVENTS : 0;
+    int result = 0;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    if(wait != 0 && timeout_ns >= 0) flags |= IORING_ENTER_EXT_ARG;
+    result = syscall(__NR_io_uring_enter, u->fd, u->queued, wait, flags,
+                     flags & IORING_ENTER_EXT_ARG ? (void *)&arg : NULL, flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0);
+    if(result == -1) return -1;
+    u->queued -= min((unsigned)result, u->queued);
+    return 0;
+}
+
+/* A cleared submission queue entry, submitting what is queued first if the queue is full */
+static struct io_uring_sqe *uring_sqe(struct microtcp_uring *u){
+    unsigned tail = *u->sq_tail;
+    struct io_uring_sqe *sqe = NULL;
+
+    while(tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries)
+        if(uring_enter(u, 0, -1) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) return NULL;
+    sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* Makes the entry uring_sqe() returned visible to the kernel */
+static void uring_push(struct microtcp_uring *u){
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+}
+
+/* Submits what is queued without waiting */
+static void uring_flush(struct microtcp_uring *u){
+    if(u->queued != 0) uring_enter(u, 0, -1);
+}
+
+/* Takes in the completions, datagrams go to rx, sends free their slots */
+static void uring_reap(struct microtcp_uring *u){
+    unsigned head = *u->cq_head, tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe = NULL;
+    microtcp_uring_slot_t *slot = NULL;
+
+    for(; head != tail; head++){
+        cqe = &u->cqes[head & u->cq_mask];
+        if(cqe->user_data == URING_RECV){
+            if(cqe->flags & IORING_CQE_F_BUFFER)
+                u->rx[(u->rx_head + u->rx_count++) % MICROTCP_URING_BUFS] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            else if(cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) u->recv_error = -cqe->res;
+            if(!(cqe->flags & IORING_CQE_F_MORE)) u->recv_armed = 0;
+        }
+        else if(cqe->user_data < MICROTCP_URING_ENTRIES){
+            slot = &u->slots[cqe->user_data];
+            slot->result = cqe->res;
+            if(cqe->res < 0 && !slot->sync) printf("(!) Queued send failed: %s\n", strerror(-cqe->res));
+            free(slot->buf);
+            slot->buf = NULL;
+            u->slots_used--;
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Arms the multishot recvmsg again if it ended and a buffer is free for it */
+static void uring_arm(microtcp_sock_t *socket){
+    struct microtcp_uring *u = socket->uring;
+    struct io_uring_sqe *sqe = NULL;
+
+    if(u->recv_armed || u->rx_count == MICROTCP_URING_BUFS || (sqe = uring_sqe(u)) == NULL) return;
+    memset(&u->recv_msg, 0, sizeof(u->recv_msg));
+    u->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    u->recv_msg.msg_controllen = CMSG_SPACE(sizeof(int));
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = socket->rx_sd;
+    sqe->addr = (uint64_t)(uintptr_t)&u->recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = URING_RECV;
+    uring_push(u);
+    u->recv_armed = 1;
+}
+
+/* Whether a datagram is waiting in rx, without blocking */
+static int uring_rx_ready(microtcp_sock_t *socket){
+    struct microtcp_uring *u = socket->uring;
+
+    uring_reap(u);
+    uring_arm(socket);
+    uring_flush(u);
+    return u->rx_count != 0;
+}
+
+/* Where the datagram of buffer bid starts, its length is set to len */
+static uint8_t *uring_payload(struct microtcp_uring *u, uint16_t bid, size_t *len){
+    uint8_t *base = u->bufs + (size_t)bid * URING_BUF_SIZE;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)base;
+    uint8_t *payload = base + sizeof(*out) + u->recv_msg.msg_namelen + u->recv_msg.msg_controllen;
+
+    *len = min(out->payloadlen, URING_BUF_SIZE - (size_t)(payload - base));
+    return payload;
+}
+
+/* Drops the oldest datagram in rx and gives its buffer back */
+static void uring_rx_pop(struct microtcp_uring *u){
+    uring_buf_give(u, u->rx[u->rx_head]);
+    u->rx_head = (u->rx_head + 1) % MICROTCP_URING_BUFS;
+    u->rx_count--;
+}
+
+/* our_recvfrom() through the ring, name gets the address of the sender unless the datagram came from a listener */
+static ssize_t uring_recvfrom(microtcp_sock_t *socket, void *buf, size_t size, uint8_t *tos, void *name, socklen_t namelen){
+    struct microtcp_uring *u = socket->uring;
+    uint64_t now = now_ns(), spin_start = 0;
+    uint64_t deadline = now + (uint64_t)socket->rcvtimeo_us * 1000, spin_until = now + (uint64_t)socket->busy_poll_us * 1000;
+    struct io_uring_recvmsg_out *out = NULL;
+    uint8_t *payload = NULL;
+    int spinning = 0;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    size_t len = 0;
+
+    uring_reap(u);
+    while(u->rx_count == 0){
+        if(u->recv_error != 0){
+            errno = u->recv_error;
+            u->recv_error = 0;
+            return -1;
+        }
+        uring_arm(socket);
+        now = now_ns();
+        if(socket->rcvtimeo_us != 0 && now >= deadline){
+            if(spinning) busy_poll_account(socket, spin_start, now, 0);
+            errno = EAGAIN;
+            return -1;
+        }
+        //MICROTCP_SO_BUSY_POLL: watch the completion queue, the kernel fills it while we spin
+        if(now < spin_until){
+            if(!spinning) spin_start = now;
+            spinning = 1;
+            uring_flush(u);
+            uring_reap(u);
+            continue;
+        }
+        if(spinning) busy_poll_account(socket, spin_start, now, 0);
+        spinning = 0;
+        if(uring_enter(u, 1, socket->rcvtimeo_us != 0 ? (int64_t)(deadline - now) : -1) == -1 && errno != ETIME && errno != EINTR)
+            return -1;
+        uring_reap(u);
+    }
+    if(spinning) busy_poll_account(socket, spin_start, now_ns(), 1);
+
+    out = (struct io_uring_recvmsg_out *)(u->bufs + (size_t)u->rx[u->rx_head] * URING_BUF_SIZE);
+    payload = uring_payload(u, u->rx[u->rx_head], &len);
+    if(name != NULL) memcpy(name, out + 1, min(out->namelen, namelen));
+    if(tos != NULL){
+        *tos = 0;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = (uint8_t *)(out + 1) + u->recv_msg.msg_namelen;
+        msg.msg_controllen = out->controllen;
+        for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+            if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS) *tos = *(uint8_t *)CMSG_DATA(cmsg);
         }
+    }
+    len = min(len, size);
+    memcpy(buf, payload, len);
+    uring_rx_pop(u);
+    return len;
+}
+
+/* Peeks at the header of the oldest datagram in rx, dropping those too short to be ours */
+static int uring_peek(microtcp_sock_t *socket, microtcp_header_t *header){
+    struct microtcp_uring *u = socket->uring;
+    uint8_t *payload = NULL;
+    size_t len = 0;
+
+    while(uring_rx_ready(socket)){
+        payload = uring_payload(u, u->rx[u->rx_head], &len);
+        if(len >= sizeof(microtcp_header_t)){
+            memcpy(header, payload, sizeof(microtcp_header_t));
+            return 1;
+        }
+        uring_rx_pop(u);
+    }
+    return 0;
+}
+
+/* our_sendto() through the ring, msg is copied. A probe waits for its result, the others are queued */
+static ssize_t uring_sendmsg(microtcp_sock_t *socket, const struct msghdr *msg, int flags, int sync){
+    struct microtcp_uring *u = socket->uring;
+    microtcp_uring_slot_t *slot = NULL;
+    struct io_uring_sqe *sqe = NULL;
+    size_t len = msg->msg_iov[0].iov_len;
+
+    //All slots in flight, the oldest sends are done soon
+    while(u->slots_used == MICROTCP_URING_ENTRIES){
+        if(uring_enter(u, 1, -1) == -1 && errno != EINTR) return -1;
+        uring_reap(u);
+    }
+    while(u->slots[u->slot_next].buf != NULL) u->slot_next = (u->slot_next + 1) % MICROTCP_URING_ENTRIES;
+    slot = &u->slots[u->slot_next];
+    if((sqe = uring_sqe(u)) == NULL) return -1;
+    if((slot->buf = malloc(len)) == NULL){
+        printf("(!) Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(slot->buf, msg->msg_iov[0].iov_base, len);
+    memcpy(&slot->addr, msg->msg_name, msg->msg_namelen);
+    memcpy(slot->control, msg->msg_control, msg->msg_controllen);
+    slot->iov.iov_base = slot->buf;
+    slot->iov.iov_len = len;
+    memset(&slot->msg, 0, sizeof(slot->msg));
+    slot->msg.msg_name = &slot->addr;
+    slot->msg.msg_namelen = msg->msg_namelen;
+    slot->msg.msg_iov = &slot->iov;
+    slot->msg.msg_iovlen = 1;
+    slot->msg.msg_control = msg->msg_controllen != 0 ? slot->control : NULL;
+    slot->msg.msg_controllen = msg->msg_controllen;
+    slot->sync = sync;
+    u->slots_used++;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = socket->sd;
+    sqe->addr = (uint64_t)(uintptr_t)&slot->msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = slot - u->slots;
+    uring_push(u);
+
+    if(sync){
+        while(slot->buf != NULL){
+            if(uring_enter(u, 1, -1) == -1 && errno != EINTR) return -1;
+            uring_reap(u);
+        }
+        if(slot->result < 0){
+            errno = -slot->result;
+            return -1;
+        }
+        return slot->result;
+    }
+    if(!u->batch && uring_enter(u, 0, -1) == -1) return -1;
+    return len;
+}
+
+/* The file descriptor that turns readable when a datagram arrives, the ring's is armed for it first */
+static int rx_fd(microtcp_sock_t *socket){
+    if(socket->uring == NULL) return socket->rx_sd;
+    uring_rx_ready(socket);
+    return socket->uring->fd;
+}
+
+/* Holds sends back while a burst goes on, they are submitted once on is 0 */
+static void uring_batch(microtcp_sock_t *socket, int on){
+    if(socket->uring == NULL) return;
+    socket->uring->batch = on;
+    if(!on) uring_flush(socket->uring);
+}
+
+/* Cancels the multishot recvmsg, waits for the kernel to be done with our memory and tears the ring down */
+static void uring_close(struct microtcp_uring *u){
+    struct io_uring_sqe *sqe = NULL;
+
+    if(u == NULL) return;
+    uring_reap(u);
+    if(u->recv_armed && (sqe = uring_sqe(u)) != NULL){
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_RECV;
+        sqe->user_data = URING_CANCEL;
+        uring_push(u);
+    }
+    while(u->recv_armed || u->slots_used != 0){
+        if(uring_enter(u, 1, -1) == -1 && errno != EINTR) break;
+        uring_reap(u);
+    }
+    uring_unmap(u);
+}
+
+/*
+ * Sets how long a read on the socket may block, 0 blocks until data arrives.
+ * our_recvfrom() waits in poll() for that long, SO_RCVTIMEO would take a
+ * system call each time the timeout changes.
+ */
+static void set_recv_timeout(microtcp_sock_t *socket, uint32_t timeout_us){
+    socket->rcvtimeo_us = timeout_us;
+}
+
+/*
+ * A read that gives up after rcvtimeo_us, if it is not 0. While datagrams
+ * keep coming one is likely to be queued already, it is taken without
+ * waiting in poll() first. With MICROTCP_SO_BUSY_POLL the read spins on
+ * non-blocking reads for that long before it waits in poll().
+ */
+static ssize_t recvmsg_timed(microtcp_sock_t *socket, struct msghdr *msg){
+    struct pollfd pfd = { socket->rx_sd, POLLIN, 0 };
+    uint64_t now = now_ns(), spin_start = 0;
+    uint64_t deadline = socket->rcvtimeo_us != 0 ? now + (uint64_t)socket->rcvtimeo_us * 1000 : UINT64_MAX;
+    uint64_t spin_until = now + (uint64_t)socket->busy_poll_us * 1000;
+    socklen_t namelen = msg->msg_namelen;
+    size_t controllen = msg->msg_controllen;
+    struct timespec ts;
+    ssize_t result = 0;
+    int ready = socket->rx_queued, spinning = 0;
+
+    while(1){
+        if(ready){
+            msg->msg_namelen = namelen;
+            msg->msg_controllen = controllen;
+            result = recvmsg(socket->rx_sd, msg, MSG_DONTWAIT);
+            if(result != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+                if(spinning) busy_poll_account(socket, spin_start, now_ns(), result != -1);
+                return result;
+            }
+        }
+        now = now_ns();
+        if(now >= deadline){
+            if(spinning) busy_poll_account(socket, spin_start, now, 0);
+            errno = EAGAIN;
+            return -1;
+        }
+        if(now < spin_until){
+            if(!spinning) spin_start = now;
+            ready = spinning = 1;
+            continue;
+        }
+        if(spinning) busy_poll_account(socket, spin_start, now, 0);
+        spinning = 0;
+        ts.tv_sec = (deadline - now) / 1000000000;
+        ts.tv_nsec = (deadline - now) % 1000000000;
+        ready = ppoll(&pfd, 1, deadline != UINT64_MAX ? &ts : NULL, NULL);
+        if(ready == -1 && errno != EINTR) return -1;
+        ready = ready > 0;
+    }
+}
+
+/*
+ * Receives a datagram from the peer. If tos is not NULL it is set to the TOS
+ * byte the datagram arrived with, which the kernel reports once ECN is set up.
+ */
+static ssize_t our_recvfrom(microtcp_sock_t *socket, void *buf, size_t size, uint8_t *tos){
+    char control[CMSG_SPACE(sizeof(int))];
+    uint8_t prefix = 0;
+    struct iovec iov[2] = { { &prefix, 1 }, { buf, size } };
+    int demux = socket->rx_sd != socket->sd;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t result = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    /*Server receives a package!*/
+    if(socket->server_ip == NULL){
+        msg.msg_name = socket->client_ip;
+        msg.msg_namelen = sizeof(*(socket->client_ip));
+    }/*Client receive a package*/
+    else{
+        msg.msg_name = socket->server_ip;
+        msg.msg_namelen = sizeof(*(socket->server_ip));
+    }
+    //The listener checked where it came from, the socketpair must not overwrite the address
+    if(demux){
+        msg.msg_name = NULL;
+        msg.msg_namelen = 0;
+    }
+    msg.msg_iov = demux ? iov : iov + 1;
+    msg.msg_iovlen = demux ? 2 : 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if(socket->uring != NULL) return uring_recvfrom(socket, buf, size, tos, msg.msg_name, msg.msg_namelen);
+    result = socket->rcvtimeo_us == 0 && socket->busy_poll_us == 0 ? recvmsg(socket->rx_sd, &msg, 0) : recvmsg_timed(socket, &msg);
+    socket->rx_queued = result >= 0;
+    //From a listener, the datagram comes after the TOS byte it arrived with
+    if(demux){
+        if(result > 0) result--;
+        if(tos != NULL) *tos = prefix;
+        return result;
+    }
+    if(tos != NULL){
+        *tos = 0;
+        for(cmsg = CMSG_FIRSTHDR(&msg); result >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+            if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS) *tos = *(uint8_t *)CMSG_DATA(cmsg);
+        }
+    }
+    return result;
+}
+
+/*
+ * Reads segments into the buffer until want bytes are in it, then takes only
+ * what can be read without blocking. With want 0 it never blocks.
+ */
+static ssize_t rcv_stream(microtcp_sock_t *socket, void *buffer, size_t length, size_t want, int flags){
+    microtcp_header_t *recv_header = malloc(sizeof(microtcp_header_t));
+    microtcp_header_t *ack_header = malloc(sizeof(microtcp_header_t));
+    size_t packet_size = sizeof(microtcp_header_t) + length, data_received = 0, chunk = 0;
+    size_t recv_size = sizeof(microtcp_header_t) + socket->local_mss;  //Never shrink the read, or segments get truncated
+    uint32_t retrieved_checksum = 0, checksum_num = 0, delack_wait = 0, elapsed = 0;
+    ssize_t received = 0, result = 0;
+    uint8_t tos = 0;
+    int ack_now = 0;
+
+    //What did not fit in the user's buffer last time comes first
+    if(socket->rcv_leftover_len != 0){
+        data_received = min(length, socket->rcv_leftover_len);
+        memcpy(buffer, socket->rcv_leftover + socket->rcv_leftover_off, data_received);
+        socket->rcv_leftover_off += data_received;
+        socket->rcv_leftover_len -= data_received;
+        socket->buf_fill_level = socket->rcv_leftover_len;
+    }
+    //The FIN arrived after data we returned by the last call
+    if(data_received == 0 && socket->state == CLOSING_BY_PEER){
+        free(recv_header);
+        free(ack_header);
+        return -1;
+    }
+
+    socket->sendbuf = malloc(sizeof(microtcp_header_t));
+
+    if(socket->sendbuf == NULL){
+        printf("(!) Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(recv_header == NULL){
+        printf("(!) Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(ack_header == NULL){
+        printf("(!) Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //initalize so it goes in while
+    recv_header->data_len = MICROTCP_MSS;
+    while(1){
+        //Some segments wait for a delayed ACK, wait for more data only until its timer runs out
+        delack_wait = 0;
+        if(socket->delack_pending){
+            elapsed = microtcp_ts_now() - socket->delack_ts;
+            if(elapsed >= MICROTCP_DELACK_TIMEOUT_US){
+                //Nothing of ours carried it in time, stop waiting for answers to piggyback on
+                socket->pingpong = 0;
+                if(our_send(socket, NULL, 0, flags) == -1){
+                    printf("(!) Error sending ACK packet!\n");
+                }
+                continue;
+            }
+            delack_wait = MICROTCP_DELACK_TIMEOUT_US - elapsed;
+        }
+
+        //Enough for the caller, hand it over unless more can be read right away
+        if(data_received == length || (data_received >= want && !rcv_ready(socket))) break;
+        //While data of ours is in flight snd_pump() reads the socket, it takes in the ACKs as well
+        if(socket->stash_len == 0 && snd_pending(socket)) break;
+
+        //our_receive() may have read a segment for us while we were sending
+        if(socket->stash_len != 0){
+            received = min(socket->stash_len, recv_size);
+            memcpy(socket->recvbuf, socket->stash, received);
+            tos = socket->stash_tos;
+            socket->stash_len = 0;
+        }
+        else{
+            set_recv_timeout(socket, delack_wait);
+
+            if((received = our_recvfrom(socket, socket->recvbuf, recv_size, &tos)) == -1){
+                if(delack_wait != 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+                perror("(!) COULD NOT RECEIVE PACKET!\n");
+                result = -1;
+                break;
+            }
+            else printf("RECEIVED PACKAGE YAY!\n");
+        }
+
+        //A datagram shorter than its header says is not ours, or got cut
+        if(received < (ssize_t)sizeof(microtcp_header_t)) continue;
+        //Retrieve the data of the header of the received packet
+        memcpy(recv_header, socket->recvbuf, sizeof(microtcp_header_t));
+        if(sizeof(microtcp_header_t) + (size_t)recv_header->data_len > (size_t)received){
+            printf("(!) Segment shorter than its header says, dropped!\n");
+            continue;
+        }
+
+
+        //!TEST TO SEE IF DUP_ACKS WORK!
+        // if(recv_header->seq_number == 5497){
+        //     checksum_num = 0;
+        //     retrieved_checksum = 0;
+        //     memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
+        //     continue;
+        // }
+        
+        //Check if checksum is correct, the data stays where it arrived
+        retrieved_checksum = recv_header->checksum;
+        recv_header->checksum = 0;
+        packet_size = sizeof(microtcp_header_t) + recv_header->data_len;
+        memcpy(socket->recvbuf, recv_header, sizeof(microtcp_header_t));
+        checksum_num = crc32(socket->recvbuf, packet_size);
+
+
+        //CHECK ACK_NUMBERS && SEQUENCE_NUMBERS
+        if(retrieved_checksum != checksum_num){
+            perror("(!) Package has not been received correctly!\n");
+            continue;
+        }
+        //The ACK that ended our handshake got lost and the server sent its SYN_ACK again
+        if(recv_header->control & MICROTCP_CTRL_SYN){
+            if(our_send(socket, NULL, 0, flags) == -1) printf("(!) Error sending ACK packet!\n");
+            continue;
+        }
+
+        //ECN: a CWR means the sender has reacted to our echo, a CE mark starts a new one
+        if(socket->ecn_ok){
+            if(recv_header->control & MICROTCP_CTRL_CWR) socket->ecn_ce_pending = 0;
+            if((tos & MICROTCP_ECN_MASK) == MICROTCP_ECN_CE){
+                socket->ecn_ce_pending = 1;
+                socket->ecn_ce_received++;
+            }
+        }
+        if(recv_header->data_len != 0) socket->peer_ack_freq = recv_header->future_use0 & MICROTCP_OPT_ACK_FREQ_MASK;
+
+        //Echo the timestamp of every segment that reaches us, in order or not,
+        //so that the sender knows which one was delivered last
+        socket->ts_recent = recv_header->future_use1;
+
+        //CHECK IF THAT WORKS
+        if(recv_header->seq_number != socket->ack_number){
+            if(our_send(socket, NULL, 0, flags) == -1){
+                printf("(!) Error sending ACK packet!\n");
+            }
+            checksum_num = 0;
+            retrieved_checksum = 0;
+            memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
+            perror("(!) Package has not been received correctly!\n");
+            continue;
+        }
+
+        printf("Package received correctly\n");
+        printf("Package - checksum: %d\n",recv_header->checksum);
+        printf("Package - future_use0: %d\n",recv_header->future_use0);
+        printf("Package - future_use1: %d\n",recv_header->future_use1);
+        printf("Package - future_use2: %d\n",recv_header->future_use2);
+        printf("Package - ack_number: %d\n",recv_header->ack_number);
+        printf("Package - seq_number: %d\n",recv_header->seq_number);
+        printf("Package - control: %d\n",recv_header->control);
+        printf("Package - data_len: %d\n",recv_header->data_len);
+        printf("Package - window: %d\n",recv_header->window);
+        printf("\n\n");
+        //Data added to recv_buff, the segments dropped above take no room in it
+        socket->buf_fill_level += (size_t)recv_header->data_len;
+
+        //If message is FIN_ACK
+        if(recv_header->control == 0b0000000000001001){ //FIN_ACK
+            printf("(!) Connection closed by peer!\n");
+            socket->state = CLOSING_BY_PEER;
+            if(data_received == 0) result = -1;     //Otherwise the next call reports it
+            break;
+        }
+
+        socket->curr_win_size = (size_t)recv_header->window << socket->snd_wscale;
+
+        //An empty segment is an ACK or a window update, only window probes ask for
+        //an answer. Two idle peers would ACK each other's ACKs forever
+        if(recv_header->data_len == 0 && !(recv_header->future_use0 & MICROTCP_OPT_ACK_NOW)) continue;
+
+        socket->ack_number = recv_header->seq_number + recv_header->data_len;
+        if(recv_header->data_len > socket->rcv_mss) socket->rcv_mss = recv_header->data_len;
+        if(recv_header->data_len != 0) rcv_rtt_update(socket, recv_header->future_use2);
+
+        //Delay the ACK of full segments until enough of them arrived or the timer runs out.
+        //Short segments usually end a send() and probes must be answered, ACK those right away.
+        //When we answer every message the answer carries the ACK, so hold it for those as well
+        socket->last_data_rcv_ts = microtcp_ts_now();
+        if(socket->delack_pending == 0) socket->delack_ts = socket->last_data_rcv_ts;
+        socket->delack_pending++;
+        ack_now = recv_header->data_len == 0 || (tos & MICROTCP_ECN_MASK) == MICROTCP_ECN_CE ||
+                  (!socket->pingpong && (recv_header->data_len < socket->rcv_mss || (recv_header->future_use0 & MICROTCP_OPT_ACK_NOW))) ||
+                  socket->delack_pending >= (socket->peer_ack_freq != 0 ? socket->peer_ack_freq : MICROTCP_DELACK_SEGMENTS);
+        if(!ack_now) socket->acks_delayed++;
+
+        //Send acknowledgement
+        if(ack_now){
+            socket->delack_pending = 0;
+            memset(ack_header,0,sizeof(microtcp_header_t));
+
+            // socket->seq_number = recv_header->seq_number + recv_header->data_len;
+
+            ack_header->data_len = 0;
+            ack_header->ack_number = socket->ack_number;
+            ack_header->seq_number = socket->seq_number;
+            ack_header->future_use0 = conn_id_opt(socket);
+            ack_header->future_use1 = microtcp_ts_now();
+            ack_header->future_use2 = socket->ts_recent;
+            ack_header->window = rcv_window(socket);
+            ack_header->checksum = 0;
+            ack_header->control = 0b0000000000001000; //Ack 
+            if(socket->ecn_ce_pending) ack_header->control |= MICROTCP_CTRL_ECE;
+
+
+            
+            
+            memcpy(socket->sendbuf, ack_header, sizeof(microtcp_header_t));
+            checksum_num = crc32(socket->sendbuf, sizeof(microtcp_header_t));
+            ack_header->checksum = checksum_num;
+            memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
+            memcpy(socket->sendbuf, ack_header, sizeof(microtcp_header_t));
+            //Sending ACK, through the ring as well, behind the data queued there
+            if(our_sendto(socket, socket->sendbuf, sizeof(microtcp_header_t), 0, 0, 0) == -1){
+                perror("(!) COULD NOT SENT ACK PACKET!\n");
+                result = -1;
+                break;
+            }
+            else printf("SENT ACK PACKAGE!\n\n");
+        }
+
+        if(recv_header->data_len == 0){
+            memset(socket->recvbuf, 0, recv_size);
+            socket->buf_fill_level = 0;
+            checksum_num = 0;
+            retrieved_checksum = 0;
+            memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
+            memset(recv_header, 0, sizeof(microtcp_header_t));
+            packet_size = sizeof(microtcp_header_t) + length - data_received;
+            continue;
+        }
+        // When our rwnd is "0" (leave 32 bytes for the incoming empty probes)
+        // if(socket->init_win_size - socket->buf_fill_level == 32){
+        //     //copy data to users_buffer
+        //     if(length >= data_received){
+        
+                // length -= MICROTCP_RECVBUF_LEN - 32;
+        //     }
+        //     else{
+        //         printf("(!)Not enough space in user's buffer to accomodate data.\n");
+        //         return -1;
+        //     }
+        //     socket->buf_fill_level = socket->buf_fill_level - sizeof(microtcp_header_t) - (size_t)recv_header->data_len;
+
+        // }
+
+        
+        
+        //Return data to user and release from recv_buff. What does not fit in
+        //the user's buffer is kept for the next call
+        chunk = min((size_t)recv_header->data_len, length - data_received);
+        memcpy((uint8_t *)buffer + data_received, socket->recvbuf + sizeof(microtcp_header_t), chunk);
+        if(chunk < recv_header->data_len){
+            if(socket->rcv_leftover == NULL && (socket->rcv_leftover = malloc(MICROTCP_MAX_MSS)) == NULL){
+                printf("(!) Memory allocation failed!\n");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(socket->rcv_leftover, socket->recvbuf + sizeof(microtcp_header_t) + chunk, recv_header->data_len - chunk);
+            socket->rcv_leftover_off = 0;
+            socket->rcv_leftover_len = recv_header->data_len - chunk;
+        }
+        data_received += chunk;
+        socket->buf_fill_level = socket->rcv_leftover_len;     //Everything else received is the user's now, or was dropped
+
+        checksum_num = 0;
+        retrieved_checksum = 0;
+        memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
+    }
+    
+    if(result != -1){
+        rcvbuf_autotune(socket, data_received);
+        //The application drained the buffer. A sender stalled on a window smaller
+        //than a segment won't send again until it hears the window opened
+        if(socket->rcv_wnd_adv < socket->rcv_mss && free_window(socket) >= socket->rcv_mss){
+            if(our_send(socket, NULL, 0, flags) == -1){
+                printf("(!) Error sending window update!\n");
+            }
+        }
+        result = data_received;
+    }
+    free(recv_header);
+    free(ack_header);
+    free(socket->sendbuf);
+    socket->sendbuf = NULL;
+
+    return result;
+}
+
+ssize_t microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags){
+    /* Block until this much is in the user's buffer, then take only what can be read without blocking */
+    size_t want = (flags & MSG_WAITALL) ? length : min(socket->rcvlowat, length);
+    int nonblock = socket->nonblock || (flags & MSG_DONTWAIT);
+    ssize_t result = 0;
+
+    flags &= ~(MSG_WAITALL | MSG_DONTWAIT);   //Ours, not for the datagrams we send
+    if(socket->engine != NULL) return engine_recv(socket, buffer, length, want);
+
+    //The peer may be waiting for what we held back or queued before it answers
+    if(!nonblock){
+        if(snd_flush(socket, flags) == -1) return -1;
+        return rcv_stream(socket, buffer, length, want, flags);
+    }
+    //Without waiting for it to be acknowledged
+    if(socket->cork_len <= snd_space(socket) && cork_flush(socket, flags) == -1) return -1;
+    if(snd_pump(socket, flags, 0) == -1) return -1;
+    result = rcv_stream(socket, buffer, length, 0, flags);
+    if(result == 0 && length != 0){
+        errno = EAGAIN;
+        return -1;
+    }
+    if(result == -1 && socket->state == CLOSING_BY_PEER) errno = ENOTCONN;
+    return result;
+}
+
+/*
+ * Single producer, single consumer byte ring between the application and the
+ * protocol I/O thread. Each side moves only its own index, the producer head
+ * once the data is in and the consumer tail once it is out, so neither of
+ * them needs a lock.
+ */
+typedef struct
+{
+    uint8_t *buf;
+    size_t size;                  /* A power of two */
+    _Atomic size_t head;
+    _Atomic size_t tail;
+} microtcp_ring_t;
+
+struct microtcp_engine
+{
+    pthread_t thread;
+    microtcp_ring_t tx;           /* Application to engine, data to send */
+    microtcp_ring_t rx;           /* Engine to application, data received in order */
+    int efd;                      /* eventfd that wakes the engine */
+    int app_efd;                  /* eventfd that wakes the application */
+    atomic_int engine_idle;       /* The engine sleeps, or is about to */
+    atomic_int app_waiting;       /* The application sleeps, or is about to */
+    atomic_int stop;              /* Hand the connection back once tx is empty */
+    atomic_int eof;               /* The peer closed the connection */
+    atomic_int error;             /* The engine failed and quit */
+};
+
+static int ring_init(microtcp_ring_t *r, size_t size){
+    r->size = 1;
+    while(r->size < size) r->size <<= 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->buf = malloc(r->size);
+    return r->buf == NULL ? -1 : 0;
+}
+
+static size_t ring_used(microtcp_ring_t *r){
+    return atomic_load_explicit(&r->head, memory_order_acquire) - atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+/* Producer: copies in as much as there is room for */
+static size_t ring_write(microtcp_ring_t *r, const void *data, size_t len){
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t off = head & (r->size - 1), first = 0;
+
+    len = min(len, r->size - (head - tail));
+    first = min(len, r->size - off);
+    memcpy(r->buf + off, data, first);
+    memcpy(r->buf, (const uint8_t *)data + first, len - first);
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+    return len;
+}
+
+/* Producer: the room that follows head without wrapping around, to be filled in place and published with ring_produce() */
+static uint8_t *ring_write_area(microtcp_ring_t *r, size_t *len){
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t off = head & (r->size - 1);
+
+    *len = min(r->size - (head - tail), r->size - off);
+    return r->buf + off;
+}
+
+static void ring_produce(microtcp_ring_t *r, size_t len){
+    atomic_store_explicit(&r->head, atomic_load_explicit(&r->head, memory_order_relaxed) + len, memory_order_release);
+}
+
+/* Consumer: copies out as much as there is */
+static size_t ring_read(microtcp_ring_t *r, void *data, size_t len){
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t off = tail & (r->size - 1), first = 0;
+
+    len = min(len, head - tail);
+    first = min(len, r->size - off);
+    memcpy(data, r->buf + off, first);
+    memcpy((uint8_t *)data + first, r->buf, len - first);
+    atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+    return len;
+}
+
+/*
+ * A side that runs out of work raises its flag, checks once more and sleeps
+ * on its eventfd. The other side writes the eventfd only if it sees the flag,
+ * so that there is no system call while both of them are busy.
+ */
+static void engine_wake(atomic_int *sleeping, int fd){
+    uint64_t one = 1;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load(sleeping) && atomic_exchange(sleeping, 0) && write(fd, &one, sizeof(one)) == -1)
+        perror("(!) Could not wake up the other thread");
+}
+
+static void engine_sleep(atomic_int *sleeping){
+    atomic_store(sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/* Data received in order that the application has not read yet */
+static size_t engine_rx_queued(microtcp_sock_t *socket){
+    return socket->engine != NULL ? ring_used(&socket->engine->rx) : 0;
+}
+
+/*
+ * The protocol I/O thread. It moves what the application wrote into the send
+ * buffer, runs the sender and hands over what arrived in order, then sleeps
+ * until a datagram comes in, the application wakes it or, while a timer
+ * runs, a tick went by.
+ */
+static void *engine_main(void *arg){
+    microtcp_sock_t *socket = arg;
+    struct microtcp_engine *e = socket->engine;
+    microtcp_sndq_t *q = &socket->snd;
+    struct pollfd fds[2];
+    uint8_t *area = NULL;
+    size_t len = 0, room = 0;
+    ssize_t got = 0;
+    uint64_t count = 0;
+
+    fds[1].fd = e->efd;
+    fds[1].events = POLLIN;
+    while(1){
+        len = min(ring_used(&e->tx), snd_space(socket));
+        if(len != 0){
+            if(q->len == 0) q->start_seq = socket->seq_number;
+            snd_reserve(socket, len);
+            ring_read(&e->tx, q->buf + q->len, len);
+            q->len += len;
+            engine_wake(&e->app_waiting, e->app_efd);
+        }
+        if(snd_pump(socket, 0, 0) == -1) break;
+
+        got = 0;
+        room = 0;
+        if(!atomic_load(&e->eof)){
+            area = ring_write_area(&e->rx, &room);
+            if(room != 0 && (got = rcv_stream(socket, area, room, 0, 0)) > 0){
+                ring_produce(&e->rx, got);
+                engine_wake(&e->app_waiting, e->app_efd);
+            }
+            else if(got == -1){
+                if(socket->state != CLOSING_BY_PEER) break;
+                atomic_store(&e->eof, 1);
+                engine_wake(&e->app_waiting, e->app_efd);
+            }
+        }
+        //What the application queued last is sent by microtcp_shutdown()
+        if(atomic_load(&e->stop) && ring_used(&e->tx) == 0) return NULL;
+        if(len != 0 || got > 0) continue;
+
+        //Datagrams are left in the socket while nobody can take them
+        engine_sleep(&e->engine_idle);
+        if(atomic_load(&e->stop) || (ring_used(&e->tx) != 0 && snd_space(socket) != 0)){
+            atomic_store(&e->engine_idle, 0);
+            continue;
+        }
+        fds[0].fd = rx_fd(socket);
+        fds[0].events = room != 0 || (snd_pending(socket) && socket->stash_len == 0) ? POLLIN : 0;
+        if(poll(fds, 2, snd_pending(socket) || socket->delack_pending ? MICROTCP_ENGINE_TICK_US / 1000 : -1) == -1 && errno != EINTR){
+            perror("(!) Protocol I/O thread could not wait");
+            break;
+        }
+        atomic_store(&e->engine_idle, 0);
+        if(fds[1].revents & POLLIN) read(e->efd, &count, sizeof(count));
+    }
+
+    atomic_store(&e->error, 1);
+    engine_wake(&e->app_waiting, e->app_efd);
+    return NULL;
+}
+
+static void engine_free(struct microtcp_engine *e){
+    if(e->efd != -1) close(e->efd);
+    if(e->app_efd != -1) close(e->app_efd);
+    free(e->tx.buf);
+    free(e->rx.buf);
+    free(e);
+}
+
+/* Hands the connection to a protocol I/O thread */
+static int engine_start(microtcp_sock_t *socket){
+    struct microtcp_engine *e = NULL;
+
+    if(socket->engine != NULL) return 0;
+    if(socket->state != ESTABLISHED){
+        errno = ENOTCONN;
+        return -1;
+    }
+    //The engine sends whatever it is given right away
+    if(cork_flush(socket, 0) == -1) return -1;
+
+    e = calloc(1, sizeof(struct microtcp_engine));
+    if(e == NULL || ring_init(&e->tx, socket->sndbuf_max) == -1 || ring_init(&e->rx, socket->rcvbuf_max) == -1){
+        printf("(!) Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&e->engine_idle, 0);
+    atomic_init(&e->app_waiting, 0);
+    atomic_init(&e->stop, 0);
+    atomic_init(&e->eof, 0);
+    atomic_init(&e->error, 0);
+    e->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    e->app_efd = eventfd(0, EFD_CLOEXEC);
+    if(e->efd == -1 || e->app_efd == -1){
+        perror("(!) Could not create eventfd");
+        engine_free(e);
+        return -1;
+    }
+
+    socket->engine = e;
+    if((errno = pthread_create(&e->thread, NULL, engine_main, socket)) != 0){
+        perror("(!) Could not start the protocol I/O thread");
+        socket->engine = NULL;
+        engine_free(e);
+        return -1;
+    }
+    return 0;
+}
+
+/* Takes the connection back from the protocol I/O thread once it sent all it was given */
+static int engine_stop(microtcp_sock_t *socket){
+    struct microtcp_engine *e = socket->engine;
+    size_t queued = 0;
+    uint8_t *buf = NULL;
+    int result = 0;
+
+    if(e == NULL) return 0;
+    atomic_store(&e->stop, 1);
+    atomic_store(&e->engine_idle, 1);
+    engine_wake(&e->engine_idle, e->efd);
+    pthread_join(e->thread, NULL);
+    socket->engine = NULL;
+    result = atomic_load(&e->error) ? -1 : 0;
+
+    //What the application did not read yet comes before what did not fit in the ring
+    queued = ring_used(&e->rx);
+    if(queued != 0){
+        buf = malloc(max(queued + socket->rcv_leftover_len, MICROTCP_MAX_MSS));
+        if(buf == NULL){
+            printf("(!) Memory allocation failed!\n");
+            exit(EXIT_FAILURE);
+        }
+        ring_read(&e->rx, buf, queued);
+        if(socket->rcv_leftover_len != 0) memcpy(buf + queued, socket->rcv_leftover + socket->rcv_leftover_off, socket->rcv_leftover_len);
+        free(socket->rcv_leftover);
+        socket->rcv_leftover = buf;
+        socket->rcv_leftover_off = 0;
+        socket->rcv_leftover_len += queued;
+        socket->buf_fill_level = socket->rcv_leftover_len;
+    }
+    engine_free(e);
+    return result;
+}
+
+/* microtcp_send() with an engine: queue into the ring, wait only while it is full */
+static ssize_t engine_send(microtcp_sock_t *socket, const void *buffer, size_t length){
+    struct microtcp_engine *e = socket->engine;
+    size_t done = 0;
+    uint64_t count = 0;
+
+    while(1){
+        done += ring_write(&e->tx, (const uint8_t *)buffer + done, length - done);
+        engine_wake(&e->engine_idle, e->efd);
+        if(done == length) return length;
+        if(atomic_load(&e->error)) return -1;
+
+        engine_sleep(&e->app_waiting);
+        if(ring_used(&e->tx) == e->tx.size && !atomic_load(&e->error) && read(e->app_efd, &count, sizeof(count)) == -1 && errno != EINTR)
+            return -1;
+        atomic_store(&e->app_waiting, 0);
+    }
+}
+
+/* microtcp_recv() with an engine: take from the ring, wait until want bytes arrived */
+static ssize_t engine_recv(microtcp_sock_t *socket, void *buffer, size_t length, size_t want){
+    struct microtcp_engine *e = socket->engine;
+    size_t got = 0;
+    uint64_t count = 0;
+    int closed = 0;
+
+    while(1){
+        closed = atomic_load(&e->eof) || atomic_load(&e->error);
+        got += ring_read(&e->rx, (uint8_t *)buffer + got, length - got);
+        if(got != 0) engine_wake(&e->engine_idle, e->efd);     //There is room for it again
+        if(got >= want) return got;
+        if(closed && ring_used(&e->rx) == 0) return got != 0 ? (ssize_t)got : -1;
+
+        engine_sleep(&e->app_waiting);
+        if(ring_used(&e->rx) == 0 && !atomic_load(&e->eof) && !atomic_load(&e->error) &&
+           read(e->app_efd, &count, sizeof(count)) == -1 && errno != EINTR)
+            return -1;
+        atomic_store(&e->app_waiting, 0);
+    }
+}
+
+/*
+ * Hierarchical timer wheel, as in Varghese and Lauck, "Hashed and
+ * Hierarchical Timing Wheels". Time goes in ticks of MICROTCP_WHEEL_TICK_US.
+ * Level 0 has a slot for each of the next 64 ticks, and each level above has
+ * slots 64 times as wide, so 4 levels reach 64^4 ticks ahead. A slot is a
+ * doubly linked list, and adding or cancelling a timer is O(1). The timers of
+ * a slot above level 0 move down a level when the wheel reaches it. A bitmap
+ * per level tells the slots in use apart, so the wheel skips the empty ones
+ * and finds the next expiry with a few bit scans.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct microtcp_timer microtcp_timer_t;
+
+struct microtcp_timer
+{
+    microtcp_timer_t *next;
+    microtcp_timer_t **pprev;     /* NULL while it is not armed */
+    uint64_t expires;             /* In ticks */
+    uint8_t level;
+    uint8_t slot;
+    void (*fire)(microtcp_timer_t *timer, void *arg);
+    void *arg;
+};
+
+typedef struct
+{
+    microtcp_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t used[WHEEL_LEVELS];  /* Bitmap of the slots that hold timers */
+    uint64_t now;                 /* The next tick to run */
+} microtcp_wheel_t;
+
+static uint64_t wheel_ticks(uint64_t ns){
+    return ns / (1000 * MICROTCP_WHEEL_TICK_US);
+}
+
+static void wheel_init(microtcp_wheel_t *w){
+    memset(w, 0, sizeof(*w));
+    w->now = wheel_ticks(now_ns());
+}
+
+static void timer_init(microtcp_timer_t *t, void (*fire)(microtcp_timer_t *timer, void *arg), void *arg){
+    memset(t, 0, sizeof(*t));
+    t->fire = fire;
+    t->arg = arg;
+}
+
+/* Puts the timer in the slot its expiry falls in, seen from the tick to run next */
+static void wheel_place(microtcp_wheel_t *w, microtcp_timer_t *t){
+    uint64_t expires = max(t->expires, w->now), delta = expires - w->now;
+    int level = 0;
+
+    //Past the last level it waits in the furthest slot and is placed again from there
+    if(delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)){
+        delta = ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        expires = w->now + delta;
+    }
+    while(level < WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) level++;
+    t->level = level;
+    t->slot = (expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    t->next = w->slots[level][t->slot];
+    if(t->next != NULL) t->next->pprev = &t->next;
+    t->pprev = &w->slots[level][t->slot];
+    *t->pprev = t;
+    w->used[level] |= (uint64_t)1 << t->slot;
+}
+
+static void timer_cancel(microtcp_wheel_t *w, microtcp_timer_t *t){
+    if(t->pprev == NULL) return;
+    *t->pprev = t->next;
+    if(t->next != NULL) t->next->pprev = t->pprev;
+    if(w->slots[t->level][t->slot] == NULL) w->used[t->level] &= ~((uint64_t)1 << t->slot);
+    t->pprev = NULL;
+}
+
+/* Arms the timer to go off timeout_us from now, or rearms it */
+static void timer_arm(microtcp_wheel_t *w, microtcp_timer_t *t, uint64_t timeout_us){
+    timer_cancel(w, t);
+    t->expires = wheel_ticks(now_ns() + timeout_us * 1000 + 1000 * MICROTCP_WHEEL_TICK_US - 1);
+    wheel_place(w, t);
+}
+
+/* Takes the whole list of a slot out of the wheel */
+static microtcp_timer_t *wheel_take(microtcp_wheel_t *w, int level, int slot){
+    microtcp_timer_t *list = w->slots[level][slot];
+
+    w->slots[level][slot] = NULL;
+    w->used[level] &= ~((uint64_t)1 << slot);
+    return list;
+}
+
+/* The distance to the first slot in use at or after bit from, circularly, 64 if there is none */
+static int wheel_scan(uint64_t used, int from){
+    uint64_t rotated = from == 0 ? used : used >> from | used << (WHEEL_SLOTS - from);
+
+    return rotated == 0 ? WHEEL_SLOTS : __builtin_ctzll(rotated);
+}
+
+/* Runs the timers that expired, those it fires may arm timers again */
+static void wheel_run(microtcp_wheel_t *w){
+    uint64_t until = wheel_ticks(now_ns()), tick = 0;
+    microtcp_timer_t *t = NULL, *next = NULL;
+    int level = 0, slot = 0, skip = 0;
+
+    //Nothing to run on the way
+    if((w->used[0] | w->used[1] | w->used[2] | w->used[3]) == 0) w->now = max(w->now, until + 1);
+    while(w->now <= until){
+        tick = w->now;
+        //At the start of a lap of a level, the slot of the level above that comes up moves down
+        for(level = 1; level < WHEEL_LEVELS && (tick & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) == 0; level++){
+            slot = (tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            for(t = wheel_take(w, level, slot); t != NULL; t = next){
+                next = t->next;
+                wheel_place(w, t);
+            }
+        }
+        t = wheel_take(w, 0, tick & (WHEEL_SLOTS - 1));
+        w->now = tick + 1;
+        for(; t != NULL; t = next){
+            next = t->next;
+            t->pprev = NULL;
+            t->fire(t, t->arg);
+        }
+        //Straight to the next slot in use, but not past the end of the lap
+        if((w->now & (WHEEL_SLOTS - 1)) == 0) continue;
+        skip = wheel_scan(w->used[0], w->now & (WHEEL_SLOTS - 1));
+        skip = min(skip, WHEEL_SLOTS - (int)(w->now & (WHEEL_SLOTS - 1)));
+        if(w->now + skip > until + 1) skip = until + 1 - w->now;
+        w->now += skip;
+    }
+}
+
+/* How long poll() may wait until the wheel has to run, in milliseconds, -1 if it holds no timers */
+static int wheel_timeout(microtcp_wheel_t *w){
+    uint64_t next = UINT64_MAX, base = 0, now = now_ns(), due = 0;
+    int level = 0;
+
+    for(level = 0; level < WHEEL_LEVELS; level++){
+        if(w->used[level] == 0) continue;
+        //The first slot of the level the wheel has not reached yet
+        base = (w->now + ((uint64_t)1 << (WHEEL_BITS * level)) - 1) >> (WHEEL_BITS * level);
+        base += wheel_scan(w->used[level], base & (WHEEL_SLOTS - 1));
+        next = min(next, base << (WHEEL_BITS * level));
+    }
+    if(next == UINT64_MAX) return -1;
+    due = next * 1000 * MICROTCP_WHEEL_TICK_US;
+    if(due <= now) return 0;
+    return (int)min((due - now + 999999) / 1000000, INT_MAX);
+}
+
+/*
+ * Listener. A thread reads every datagram that arrives on the port and hands
+ * it to its connection, the TOS byte it arrived with in front, through a
+ * datagram socketpair whose other end is the connection's rx_sd. Connections
+ * are found in an open-addressing table with linear probing. Its entries are
+ * small and next to each other, so a lookup mostly touches one cache line.
+ *
+ * The thread runs the handshakes as well, as many at once as the backlog
+ * allows, and retransmits the SYN-ACKs that get no ACK. Connections whose
+ * handshake completed wait for microtcp_accept_conn() in the order they
+ * completed, so a slow or lost client holds up nobody but itself.
+ *
+ * Past a threshold SYNs get SYN cookies instead. The ISS of the SYN-ACK is
+ *   bits 31..27  a counter that ticks every MICROTCP_SYNCOOKIE_TICK_S seconds
+ *   bits 26..0   a keyed hash of the key, the client's ISN and the counter,
+ *                plus the options of the SYN in 9 bits:
+ *                MSS index (0..2), window scale present (3), window scale
+ *                (4..7), ECN offered (8)
+ * An ACK of no connection we know of is checked against it. The hash leaves
+ * 18 bits for a forged ACK to guess.
+ */
+#define FLOW_EMPTY 0
+#define FLOW_USED 1
+#define FLOW_DELETED 2
+
+typedef struct
+{
+    microtcp_flow_key_t key;
+    uint8_t state;
+    int fd;                       /* Our end of the connection's socketpair, -1 during the handshake */
+    int hs;                       /* Slot of its handshake while that is in progress, -1 after */
+} microtcp_flow_t;
+
+/* A handshake waiting for the ACK of our SYN-ACK */
+typedef struct
+{
+    microtcp_flow_key_t key;
+    microtcp_header_t syn;
+    microtcp_header_t synack;
+    uint32_t rto_us;              /* 0 if the slot is free */
+    microtcp_timer_t timer;       /* Retransmits the SYN-ACK */
+    uint8_t retries;
+} microtcp_hs_t;
+
+/* A connection whose handshake completed, waiting for microtcp_accept_conn() */
+typedef struct
+{
+    microtcp_flow_key_t key;
+    microtcp_header_t syn;
+    uint32_t iss;
+    int fd;                       /* The connection's end of the socketpair */
+} microtcp_pending_t;
+
+struct microtcp_listener
+{
+    pthread_t thread;
+    pthread_mutex_t lock;         /* Guards the table and the accept queue */
+    pthread_cond_t conn_ready;
+    microtcp_flow_t *flows;
+    size_t nflows;                /* A power of two */
+    size_t used;
+    size_t deleted;               /* Tombstones, they end no probe sequence */
+    microtcp_hs_t *hs;            /* Handshakes in progress, the thread's own */
+    int *hs_free;                 /* Free slots of hs */
+    size_t hs_nfree;
+    microtcp_wheel_t wheel;       /* The timers of hs, the thread's own */
+    microtcp_pending_t *queue;    /* Completed connections, oldest first */
+    size_t backlog;
+    size_t queue_head;
+    size_t queue_count;
+    microtcp_sock_t tmpl;         /* Connections start out as a copy of this */
+    uint64_t cookie_secret[2];
+    int sd;
+    uint16_t local_port;
+    int efd;                      /* Stops the thread */
+    int ready_fd;                 /* Readable while the accept queue has a connection */
+    atomic_int stop;
+    atomic_int closing;           /* No more accepts, the thread runs on for the connections' teardown */
+};
+
+#define COOKIE_COUNT_SHIFT 27
+#define COOKIE_HASH_MASK 0x07ffffff
+#define COOKIE_OPTS_BITS 9
+#define COOKIE_OPT_WSCALE 0x008
+#define COOKIE_OPT_WSCALE_SHIFT 4
+#define COOKIE_OPT_ECN 0x100
+
+/* MSS values a SYN cookie can tell, a SYN's is rounded down to one of them */
+static const uint16_t cookie_mss[] = { MICROTCP_MIN_MSS, 1024, 1200, MICROTCP_MSS, 1460, 4096, 8192, MICROTCP_MAX_MSS };
+
+static uint64_t mix64(uint64_t h){
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* The connection ID is left out, so that a key without one finds the connections of its 4-tuple */
+static size_t flow_hash(const microtcp_flow_key_t *key){
+    return mix64(((uint64_t)key->peer_addr << 32 | (uint32_t)key->peer_port << 16 | key->local_port) ^
+                 (uint64_t)key->local_addr * 0x9e3779b97f4a7c15ULL);
+}
+
+static int flow_match(const microtcp_flow_key_t *key, const microtcp_flow_key_t *entry){
+    return key->peer_addr == entry->peer_addr && key->peer_port == entry->peer_port &&
+           key->local_addr == entry->local_addr && key->local_port == entry->local_port &&
+           (key->conn_id == 0 || key->conn_id == entry->conn_id);
+}
+
+static microtcp_flow_t *flow_find(struct microtcp_listener *l, const microtcp_flow_key_t *key){
+    size_t i = flow_hash(key) & (l->nflows - 1);
+
+    while(l->flows[i].state != FLOW_EMPTY){
+        if(l->flows[i].state == FLOW_USED && flow_match(key, &l->flows[i].key)) return &l->flows[i];
+        i = (i + 1) & (l->nflows - 1);
+    }
+    return NULL;
+}
+
+static void flow_place(struct microtcp_listener *l, const microtcp_flow_key_t *key, int fd, int hs){
+    size_t i = flow_hash(key) & (l->nflows - 1);
+
+    while(l->flows[i].state == FLOW_USED) i = (i + 1) & (l->nflows - 1);
+    if(l->flows[i].state == FLOW_DELETED) l->deleted--;
+    l->flows[i].key = *key;
+    l->flows[i].fd = fd;
+    l->flows[i].hs = hs;
+    l->flows[i].state = FLOW_USED;
+}
+
+/* The table is rebuilt before it gets half full, tombstones included, which keeps probe sequences short */
+static void flow_insert(struct microtcp_listener *l, const microtcp_flow_key_t *key, int fd, int hs){
+    microtcp_flow_t *old = l->flows;
+    size_t nold = l->nflows, i = 0;
+
+    if(2 * (l->used + l->deleted + 1) > l->nflows){
+        while(4 * (l->used + 1) > l->nflows) l->nflows *= 2;
+        l->flows = calloc(l->nflows, sizeof(microtcp_flow_t));
+        if(l->flows == NULL){
+            printf("(!) Memory allocation failed!\n");
+            exit(EXIT_FAILURE);
+        }
+        l->deleted = 0;
+        for(i = 0; i < nold; i++)
+            if(old[i].state == FLOW_USED) flow_place(l, &old[i].key, old[i].fd, old[i].hs);
+        free(old);
+    }
+    flow_place(l, key, fd, hs);
+    l->used++;
+}
+
+static void flow_delete(struct microtcp_listener *l, microtcp_flow_t *flow){
+    if(flow->fd != -1) close(flow->fd);
+    flow->state = FLOW_DELETED;
+    l->used--;
+    l->deleted++;
+}
+
+/*
+ * Opens the socketpair of a connection. Datagrams the connection did not
+ * read yet are charged to our end, which is sized for a receive buffer of
+ * size bytes. Returns how much of it the kernel lets our end hold, 0 on failure.
+ */
+static size_t pair_open(int fds[2], size_t size){
+    int val = (int)size;
+    socklen_t len = sizeof(val);
+
+    if(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) == -1){
+        perror("(!) Could not create the connection's socketpair");
+        return 0;
+    }
+    if(setsockopt(fds[1], SOL_SOCKET, SO_SNDBUFFORCE, &val, sizeof(val)) == -1)
+        setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &val, sizeof(val));
+    if(getsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &val, &len) == -1) return size;
+    return min(size, (size_t)val / 2);
+}
+
+/* Checks the checksum of a segment received in full */
+static int segment_ok(uint8_t *packet, size_t len){
+    microtcp_header_t header;
+    uint32_t zero = 0;
+    int ok = 0;
+
+    if(len < sizeof(header)) return 0;
+    memcpy(&header, packet, sizeof(header));
+    if(sizeof(header) + (size_t)header.data_len > len) return 0;
+    memcpy(packet + offsetof(microtcp_header_t, checksum), &zero, sizeof(zero));
+    ok = crc32(packet, sizeof(header) + header.data_len) == header.checksum;
+    memcpy(packet + offsetof(microtcp_header_t, checksum), &header.checksum, sizeof(header.checksum));
+    return ok;
+}
+
+static uint32_t cookie_count(void){
+    return now_ns() / ((uint64_t)MICROTCP_SYNCOOKIE_TICK_S * 1000000000);
+}
+
+static uint32_t cookie_hash(struct microtcp_listener *l, const microtcp_flow_key_t *key, uint32_t isn, uint32_t count){
+    uint64_t h = l->cookie_secret[0];
+
+    h = mix64(h ^ ((uint64_t)key->peer_addr << 32 | key->local_addr));
+    h = mix64(h ^ ((uint64_t)key->peer_port << 48 | (uint64_t)key->local_port << 32 | isn));
+    h = mix64(h ^ count ^ l->cookie_secret[1]);
+    return (uint32_t)h;
+}
+
+/* The ISS of our SYN-ACK to syn, with the options of syn in it */
+static uint32_t cookie_make(struct microtcp_listener *l, const microtcp_flow_key_t *key, const microtcp_header_t *syn){
+    uint32_t mss = syn->future_use0 & MICROTCP_OPT_MSS_MASK, opts = 0, count = cookie_count();
+
+    if(mss == 0) mss = MICROTCP_MSS;
+    while(opts + 1 < sizeof(cookie_mss) / sizeof(cookie_mss[0]) && cookie_mss[opts + 1] <= mss) opts++;
+    if(syn->future_use0 & MICROTCP_OPT_WSCALE)
+        opts |= COOKIE_OPT_WSCALE | min((syn->future_use0 >> MICROTCP_OPT_WSCALE_SHIFT) & 0xff, MICROTCP_MAX_WSCALE) << COOKIE_OPT_WSCALE_SHIFT;
+    if((syn->control & (MICROTCP_CTRL_ECE | MICROTCP_CTRL_CWR)) == (MICROTCP_CTRL_ECE | MICROTCP_CTRL_CWR)) opts |= COOKIE_OPT_ECN;
+    return count << COOKIE_COUNT_SHIFT | ((cookie_hash(l, key, syn->seq_number, count) + opts) & COOKIE_HASH_MASK);
+}
+
+/*
+ * Checks the ISS an ACK acknowledges against the cookie its SYN would have
+ * got, in this tick or the one before. If it matches, rebuilds the SYN as
+ * far as syn_setup() needs it and returns 0.
+ */
+static int cookie_check(struct microtcp_listener *l, const microtcp_flow_key_t *key, const microtcp_header_t *ack, microtcp_header_t *syn){
+    uint32_t isn = ack->seq_number - 1, iss = ack->ack_number - 1, count = cookie_count(), opts = 0;
+    int i = 0;
+
+    if(conn_id_of(isn) != key->conn_id) return -1;
+    for(i = 0; i < 2; i++, count--){
+        if((count << COOKIE_COUNT_SHIFT) != (iss & ~COOKIE_HASH_MASK)) continue;
+        opts = (iss - cookie_hash(l, key, isn, count)) & COOKIE_HASH_MASK;
+        if(opts >> COOKIE_OPTS_BITS) continue;
+
+        memset(syn, 0, sizeof(microtcp_header_t));
+        syn->seq_number = isn;
+        syn->control = MICROTCP_CTRL_SYN;
+        if(opts & COOKIE_OPT_ECN) syn->control |= MICROTCP_CTRL_ECE | MICROTCP_CTRL_CWR;
+        syn->future_use0 = cookie_mss[opts & 0x7];
+        if(opts & COOKIE_OPT_WSCALE)
+            syn->future_use0 |= MICROTCP_OPT_WSCALE | ((opts >> COOKIE_OPT_WSCALE_SHIFT) & 0xf) << MICROTCP_OPT_WSCALE_SHIFT;
+        syn->window = ack->window;
+        return 0;
+    }
+    return -1;
+}
+
+/* SYNs get cookies once the handshakes in progress pass the threshold */
+static int cookie_needed(struct microtcp_listener *l){
+    if(l->tmpl.syncookies == MICROTCP_SYNCOOKIES_ALWAYS) return 1;
+    return l->tmpl.syncookies == MICROTCP_SYNCOOKIES_AUTO &&
+           (l->backlog - l->hs_nfree) * 100 >= l->backlog * MICROTCP_SYNCOOKIE_PCT;
+}
+
+/*
+ * Queues a connection whose handshake completed for microtcp_accept_conn().
+ * Returns our end of its socketpair, -1 if the queue is full.
+ */
+static int listener_queue(struct microtcp_listener *l, const microtcp_flow_key_t *key, const microtcp_header_t *syn, uint32_t iss){
+    microtcp_pending_t *pending = NULL;
+    int fds[2];
+
+    if(l->queue_count == l->backlog) return -1;
+    if(pair_open(fds, l->tmpl.rcvbuf_max) == 0) return -1;
+    pending = &l->queue[(l->queue_head + l->queue_count) % l->backlog];
+    pending->key = *key;
+    pending->syn = *syn;
+    pending->iss = iss;
+    pending->fd = fds[0];
+    if(l->queue_count++ == 0) eventfd_write(l->ready_fd, 1);
+    pthread_cond_signal(&l->conn_ready);
+    return fds[1];
+}
+
+static void listener_send(struct microtcp_listener *l, const microtcp_flow_key_t *key, const microtcp_header_t *header){
+    struct sockaddr_in peer;
+
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family = AF_INET;
+    peer.sin_addr.s_addr = key->peer_addr;
+    peer.sin_port = key->peer_port;
+    if(sendto(l->sd, header, sizeof(microtcp_header_t), 0, (struct sockaddr *)&peer, sizeof(peer)) == -1)
+        perror("(!) COULD NOT SENT SYN_ACK PACKET!\n");
+}
+
+/* A SYN of a new connection, it takes a free handshake slot or gets a cookie */
+static void listener_syn(struct microtcp_listener *l, const microtcp_flow_key_t *key, const microtcp_header_t *syn){
+    microtcp_sock_t conn = l->tmpl;
+    microtcp_header_t synack;
+    int slot = 0;
+    microtcp_hs_t *hs = NULL;
+
+    if(cookie_needed(l) || l->hs_nfree == 0){
+        if(l->tmpl.syncookies == MICROTCP_SYNCOOKIES_OFF) return;
+        syn_setup(&conn, syn, cookie_make(l, key, syn), &synack);
+        listener_send(l, key, &synack);
+        return;
+    }
+    slot = l->hs_free[--l->hs_nfree];
+    hs = &l->hs[slot];
+    hs->key = *key;
+    hs->syn = *syn;
+    syn_setup(&conn, syn, (uint32_t)rand(), &hs->synack);
+    hs->rto_us = MICROTCP_SYN_RTO_US;
+    hs->retries = 0;
+    timer_arm(&l->wheel, &hs->timer, hs->rto_us);
+    flow_insert(l, key, -1, slot);
+    listener_send(l, key, &hs->synack);
+}
+
+/*
+ * A segment of a connection whose handshake is in progress. The ACK of our
+ * SYN-ACK completes it, and so does any segment that acknowledges it, data
+ * included if the ACK itself got lost.
+ */
+static void listener_handshake(struct microtcp_listener *l, microtcp_flow_t *flow, const microtcp_header_t *header, uint8_t *buf, size_t len){
+    microtcp_hs_t *hs = &l->hs[flow->hs];
+    int fd = -1;
+
+    //The client did not get our SYN-ACK and sent its SYN again
+    if(header->control & MICROTCP_CTRL_SYN){
+        listener_send(l, &hs->key, &hs->synack);
+        return;
+    }
+    if(!(header->control & MICROTCP_CTRL_ACK) || header->ack_number != hs->synack.seq_number + 1 || !segment_ok(buf + 1, len - 1))
+        return;
+    //With the accept queue full the ACK is dropped, the handshake completes with one the client sends later
+    fd = listener_queue(l, &hs->key, &hs->syn, hs->synack.seq_number);
+    if(fd == -1) return;
+    hs->rto_us = 0;
+    timer_cancel(&l->wheel, &hs->timer);
+    l->hs_free[l->hs_nfree++] = flow->hs;
+    flow->hs = -1;
+    flow->fd = fd;
+    if(header->data_len != 0 || (header->control & MICROTCP_CTRL_FIN)) send(flow->fd, buf, len, MSG_DONTWAIT);
+}
+
+/* A segment of no connection we know of, it may acknowledge a SYN cookie */
+static void listener_cookie_ack(struct microtcp_listener *l, const microtcp_flow_key_t *key, const microtcp_header_t *header, uint8_t *buf, size_t len){
+    microtcp_header_t syn;
+    int fd = -1;
+
+    if(!(header->control & MICROTCP_CTRL_ACK) || cookie_check(l, key, header, &syn) == -1 || !segment_ok(buf + 1, len - 1))
+        return;
+    fd = listener_queue(l, key, &syn, header->ack_number - 1);
+    if(fd == -1) return;
+    flow_insert(l, key, fd, -1);
+    if(header->data_len != 0 || (header->control & MICROTCP_CTRL_FIN)) send(fd, buf, len, MSG_DONTWAIT);
+}
+
+/*
+ * The SYN-ACK of a handshake timed out. It is retransmitted with exponential
+ * backoff, and the handshake is dropped once it runs out of retries.
+ */
+static void listener_synack_timeout(microtcp_timer_t *timer, void *arg){
+    struct microtcp_listener *l = arg;
+    microtcp_hs_t *hs = (microtcp_hs_t *)((uint8_t *)timer - offsetof(microtcp_hs_t, timer));
+    microtcp_flow_t *flow = NULL;
+
+    if(hs->retries == MICROTCP_SYNACK_RETRIES){
+        pthread_mutex_lock(&l->lock);
+        flow = flow_find(l, &hs->key);
+        if(flow != NULL) flow_delete(l, flow);
+        pthread_mutex_unlock(&l->lock);
+        hs->rto_us = 0;
+        l->hs_free[l->hs_nfree++] = hs - l->hs;
+        return;
+    }
+    hs->retries++;
+    hs->rto_us = min(2 * (uint64_t)hs->rto_us, MICROTCP_MAX_RTO_US);
+    timer_arm(&l->wheel, &hs->timer, hs->rto_us);
+    listener_send(l, &hs->key, &hs->synack);
+}
+
+/* Takes a connection out of its listener's table once it is shut down */
+static void listener_remove(microtcp_sock_t *socket){
+    struct microtcp_listener *l = socket->listener;
+    microtcp_flow_t *flow = NULL;
+
+    pthread_mutex_lock(&l->lock);
+    flow = flow_find(l, &socket->flow);
+    if(flow != NULL) flow_delete(l, flow);
+    pthread_mutex_unlock(&l->lock);
+    close(socket->rx_sd);
+    socket->rx_sd = socket->sd;
+    socket->listener = NULL;
+}
+
+static void *listener_main(void *arg){
+    struct microtcp_listener *l = arg;
+    uint8_t buf[1 + sizeof(microtcp_header_t) + MICROTCP_MAX_MSS];
+    char control[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct in_pktinfo))];
+    struct sockaddr_in peer;
+    struct iovec iov = { buf + 1, sizeof(buf) - 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg = NULL;
+    struct pollfd fds[2];
+    microtcp_header_t header;
+    microtcp_flow_key_t key;
+    microtcp_flow_t *flow = NULL;
+    ssize_t len = 0;
+
+    fds[0].fd = l->sd;
+    fds[0].events = POLLIN;
+    fds[1].fd = l->efd;
+    fds[1].events = POLLIN;
+    while(!atomic_load(&l->stop)){
+        wheel_run(&l->wheel);
+        if(poll(fds, 2, wheel_timeout(&l->wheel)) == -1 && errno != EINTR){
+            perror("(!) Listener could not wait");
+            break;
+        }
+        //Take all there is before waiting again
+        while(1){
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_name = &peer;
+            msg.msg_namelen = sizeof(peer);
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            len = recvmsg(l->sd, &msg, MSG_DONTWAIT);
+            if(len == -1) break;
+            if(len < (ssize_t)sizeof(microtcp_header_t)) continue;
+
+            buf[0] = 0;
+            memset(&key, 0, sizeof(key));
+            for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+                if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS) buf[0] = *(uint8_t *)CMSG_DATA(cmsg);
+                if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+                    key.local_addr = ((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_addr.s_addr;
+            }
+            memcpy(&header, buf + 1, sizeof(header));
+            key.peer_addr = peer.sin_addr.s_addr;
+            key.peer_port = peer.sin_port;
+            key.local_port = l->local_port;
+            //A SYN carries no ID yet, the one its connection is going to have comes from its sequence number
+            if(header.control & MICROTCP_CTRL_SYN) key.conn_id = conn_id_of(header.seq_number);
+            else key.conn_id = header.future_use0 >> MICROTCP_OPT_CONN_ID_SHIFT;
+
+            pthread_mutex_lock(&l->lock);
+            flow = flow_find(l, &key);
+            //A connection that does not keep up loses datagrams, as it would on a full UDP socket
+            if(flow != NULL && flow->hs == -1) send(flow->fd, buf, len + 1, MSG_DONTWAIT);
+            else if(flow != NULL) listener_handshake(l, flow, &header, buf, len + 1);
+            else if((header.control & (MICROTCP_CTRL_SYN | MICROTCP_CTRL_ACK)) == MICROTCP_CTRL_SYN){
+                if(segment_ok(buf + 1, len)) listener_syn(l, &key, &header);
+            }
+            else if(l->tmpl.syncookies != MICROTCP_SYNCOOKIES_OFF) listener_cookie_ack(l, &key, &header, buf, len + 1);
+            pthread_mutex_unlock(&l->lock);
+        }
+    }
+    return NULL;
+}
+
+int microtcp_listen (microtcp_sock_t *socket, int backlog){
+    struct microtcp_listener *l = NULL;
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    size_t pair_size = 0;
+    pthread_condattr_t cattr;
+    int on = 1, fds[2], i = 0;
+
+    if(socket->state != BINDED || backlog < 1){
+        errno = EINVAL;
+        return -1;
+    }
+    if(getsockname(socket->sd, (struct sockaddr *)&local, &len) == -1) return -1;
+    if(setsockopt(socket->sd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)) == -1 ||
+       setsockopt(socket->sd, IPPROTO_IP, IP_RECVTOS, &on, sizeof(on)) == -1){
+        perror("(!) Could not set up the listening socket");
+        return -1;
+    }
+    //The port takes the datagrams of all the connections, and sends them
+    rcvbuf_resize(socket, socket->rcvbuf_max);
+    pmtu_setup(socket);
+    //A connection's receive buffer grows no larger than its socketpair holds
+    pair_size = pair_open(fds, socket->rcvbuf_max);
+    if(pair_size == 0) return -1;
+    close(fds[0]);
+    close(fds[1]);
+
+    l = calloc(1, sizeof(struct microtcp_listener));
+    if(l == NULL || (l->hs = calloc(backlog, sizeof(microtcp_hs_t))) == NULL ||
+       (l->hs_free = calloc(backlog, sizeof(int))) == NULL ||
+       (l->queue = calloc(backlog, sizeof(microtcp_pending_t))) == NULL ||
+       (l->flows = calloc(MICROTCP_LISTEN_FLOWS_INIT, sizeof(microtcp_flow_t))) == NULL){
+        printf("(!) Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    l->nflows = MICROTCP_LISTEN_FLOWS_INIT;
+    l->backlog = backlog;
+    for(i = 0; i < backlog; i++){
+        l->hs_free[i] = backlog - 1 - i;
+        timer_init(&l->hs[i].timer, listener_synack_timeout, l);
+    }
+    wheel_init(&l->wheel);
+    l->hs_nfree = backlog;
+    l->sd = socket->sd;
+    l->local_port = local.sin_port;
+    //io_uring is for sockets that read their own port, here the thread does and a ring per connection only adds system calls
+    uring_close(socket->uring);
+    socket->uring = NULL;
+    //Its rx_sd tells that the connections don't read the port themselves
+    l->tmpl = *socket;
+    l->tmpl.rx_sd = -1;
+    l->tmpl.listener = l;
+    l->tmpl.rcvbuf_max = max(pair_size, 2 * MICROTCP_MAX_MSS);
+    if(getrandom(l->cookie_secret, sizeof(l->cookie_secret), 0) != sizeof(l->cookie_secret)){
+        l->cookie_secret[0] = (uint64_t)rand() << 32 ^ rand() ^ now_ns();
+        l->cookie_secret[1] = (uint64_t)rand() << 32 ^ rand();
+    }
+    atomic_init(&l->stop, 0);
+    atomic_init(&l->closing, 0);
+    pthread_mutex_init(&l->lock, NULL);
+    //Timed waits of the runtime's workers go by the monotonic clock
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&l->conn_ready, &cattr);
+    pthread_condattr_destroy(&cattr);
+    l->efd = eventfd(0, EFD_CLOEXEC);
+    l->ready_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(l->efd == -1 || l->ready_fd == -1 || (errno = pthread_create(&l->thread, NULL, listener_main, l)) != 0){
+        perror("(!) Could not start the listener");
+        if(l->efd != -1) close(l->efd);
+        if(l->ready_fd != -1) close(l->ready_fd);
+        free(l->hs);
+        free(l->hs_free);
+        free(l->queue);
+        free(l->flows);
+        free(l);
+        return -1;
+    }
+
+    socket->listener = l;
+    socket->state = LISTEN;
+    return 0;
+}
+
+/*
+ * Takes the oldest connection of the accept queue, waiting for one at most
+ * wait_us, or for as long as it takes if that is negative. Fails with EAGAIN
+ * if none came, and with ECONNABORTED once the listener is stopped.
+ */
+static int listener_accept(microtcp_sock_t *socket, microtcp_sock_t *conn, struct sockaddr *address, socklen_t address_len, long wait_us){
+    struct microtcp_listener *l = socket->listener;
+    struct sockaddr_in *peer = (struct sockaddr_in *)address;
+    microtcp_pending_t pending;
+    microtcp_header_t synack;
+    struct timespec deadline;
+    uint64_t until = 0;
+
+    if(l == NULL || socket->state != LISTEN || address_len < sizeof(struct sockaddr_in)){
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(wait_us > 0){
+        until = now_ns() + (uint64_t)wait_us * 1000;
+        deadline.tv_sec = until / 1000000000;
+        deadline.tv_nsec = until % 1000000000;
+    }
+    pthread_mutex_lock(&l->lock);
+    while(l->queue_count == 0 && !atomic_load(&l->stop) && !atomic_load(&l->closing) && wait_us != 0)
+        if(wait_us < 0) pthread_cond_wait(&l->conn_ready, &l->lock);
+        else if(pthread_cond_timedwait(&l->conn_ready, &l->lock, &deadline) == ETIMEDOUT) break;
+    if(l->queue_count == 0 || atomic_load(&l->closing)){
+        errno = atomic_load(&l->stop) || atomic_load(&l->closing) ? ECONNABORTED : EAGAIN;
+        pthread_mutex_unlock(&l->lock);
+        return -1;
+    }
+    pending = l->queue[l->queue_head];
+    l->queue_head = (l->queue_head + 1) % l->backlog;
+    if(--l->queue_count == 0) eventfd_read(l->ready_fd, &(eventfd_t){0});
+    pthread_mutex_unlock(&l->lock);
+
+    //The listener answered the SYN from a copy of the template as well, this arrives at the same state
+    *conn = l->tmpl;
+    conn->rx_sd = pending.fd;
+    conn->flow = pending.key;
+    memset(peer, 0, sizeof(*peer));
+    peer->sin_family = AF_INET;
+    peer->sin_addr.s_addr = pending.key.peer_addr;
+    peer->sin_port = pending.key.peer_port;
+    conn->client_ip = peer;
+    conn->server_ip = NULL;
+    syn_setup(conn, &pending.syn, pending.iss, &synack);
+    conn->seq_number += 1;
+    conn->state = ESTABLISHED;
+
+    conn->recvbuf = malloc(sizeof(microtcp_header_t) + MICROTCP_MAX_MSS);
+    if(conn->recvbuf == NULL){
+        printf("(!) Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+int microtcp_accept_conn (microtcp_sock_t *socket, microtcp_sock_t *conn, struct sockaddr *address, socklen_t address_len){
+    return listener_accept(socket, conn, address, address_len, socket->nonblock ? 0 : -1);
+}
+
+/* Stops the listener's thread, microtcp_accept_conn() calls waiting on it fail with ECONNABORTED */
+static void listener_interrupt(struct microtcp_listener *l){
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&l->lock);
+    atomic_store(&l->stop, 1);
+    pthread_cond_broadcast(&l->conn_ready);
+    pthread_mutex_unlock(&l->lock);
+    if(write(l->efd, &one, sizeof(one)) == -1) perror("(!) Could not stop the listener");
+}
+
+/*
+ * Fails microtcp_accept_conn() calls with ECONNABORTED, those waiting as well,
+ * but keeps the thread running for the connections that are still to be shut down
+ */
+static void listener_abort(struct microtcp_listener *l){
+    pthread_mutex_lock(&l->lock);
+    atomic_store(&l->closing, 1);
+    pthread_cond_broadcast(&l->conn_ready);
+    pthread_mutex_unlock(&l->lock);
+}
+
+/* Stops the listener of a listening socket, its connections must be shut down already */
+static int listener_stop(microtcp_sock_t *socket){
+    struct microtcp_listener *l = socket->listener;
+    size_t i = 0;
+
+    listener_interrupt(l);
+    pthread_join(l->thread, NULL);
+    for(i = 0; i < l->nflows; i++)
+        if(l->flows[i].state == FLOW_USED && l->flows[i].fd != -1) close(l->flows[i].fd);
+    for(i = 0; i < l->queue_count; i++) close(l->queue[(l->queue_head + i) % l->backlog].fd);
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->conn_ready);
+    close(l->efd);
+    close(l->ready_fd);
+    free(l->flows);
+    free(l->hs);
+    free(l->hs_free);
+    free(l->queue);
+    free(l);
+    socket->listener = NULL;
+    socket->state = CLOSED;
+    return 0;
+}
+
+/*
+ * Sharded server runtime. Every worker has a listening socket of its own on
+ * the port, with SO_REUSEPORT the kernel spreads the clients over them by
+ * the hash of their 4-tuple, and all the datagrams of a connection reach the
+ * same one. A worker and its listener's thread run on one CPU.
+ *
+ * The connections of a worker that yield wait on its deque, a Chase-Lev one
+ * with the orderings of Le et al., "Correct and Efficient Work-Stealing for
+ * Weak Memory Models". Only the worker pushes, at the bottom. It takes from
+ * the top like the thieves do, and not the last connection it pushed, or a
+ * connection that keeps yielding would run again and again while the others
+ * wait for an idle worker to come along. A connection goes from a thread to
+ * another through the deque alone, no lock is shared between workers. A
+ * worker that runs out of connections may also take from the accept queue of
+ * another's listener, which only that listener's lock guards.
+ */
+typedef struct
+{
+    microtcp_sock_t conn;
+    struct sockaddr_in peer;      /* What conn.client_ip points to */
+} microtcp_task_t;
+
+typedef struct
+{
+    atomic_long top;              /* Where connections are taken */
+    char pad[64 - sizeof(atomic_long)];
+    atomic_long bottom;           /* Where the worker pushes */
+    _Atomic(microtcp_task_t *) buf[MICROTCP_RUNTIME_DEQUE];
+} microtcp_deque_t;
+
+struct microtcp_shard
+{
+    microtcp_sock_t sock;         /* The shard's listening socket */
+    microtcp_deque_t deque;
+    microtcp_task_t *spare;       /* Allocated for the next connection accepted */
+    unsigned int seed;            /* Picks the first worker to steal from */
+    pthread_t worker;
+    int cpu;
+    struct microtcp_runtime *rt;
+};
+
+struct microtcp_runtime
+{
+    struct microtcp_shard *shards;
+    int nshards;                  /* Shards listening */
+    int nworkers;                 /* Of which the workers have started */
+    microtcp_handler_t handler;
+    void *arg;
+    atomic_int stop;
+};
+
+/* Worker: fails if the deque is full */
+static int deque_push(microtcp_deque_t *d, microtcp_task_t *task){
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+
+    if(b - t >= MICROTCP_RUNTIME_DEQUE) return -1;
+    atomic_store_explicit(&d->buf[b & (MICROTCP_RUNTIME_DEQUE - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+/* Anyone: the connection pushed first, NULL if there is none */
+static microtcp_task_t *deque_steal(microtcp_deque_t *d){
+    microtcp_task_t *task = NULL;
+    long t = 0, b = 0;
+
+    do{
+        t = atomic_load_explicit(&d->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+        if(t >= b) return NULL;
+        task = atomic_load_explicit(&d->buf[t & (MICROTCP_RUNTIME_DEQUE - 1)], memory_order_relaxed);
+    }while(!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed));
+    return task;
+}
+
+static int pin_thread(pthread_t thread, int cpu){
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+/* A connection from the accept queue of sock, see listener_accept() for wait_us */
+static microtcp_task_t *runtime_accept(struct microtcp_shard *shard, microtcp_sock_t *sock, long wait_us){
+    microtcp_task_t *task = shard->spare;
+
+    if(task == NULL && (task = malloc(sizeof(microtcp_task_t))) == NULL){
+        printf("(!) Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    shard->spare = task;
+    if(listener_accept(sock, &task->conn, (struct sockaddr *)&task->peer, sizeof(task->peer), wait_us) == -1) return NULL;
+    shard->spare = NULL;
+    return task;
+}
+
+/*
+ * The next connection to run: a new one of our own listener so that arrivals
+ * don't wait behind those that keep yielding, else one of our deque, else one
+ * stolen from another worker.
+ */
+static microtcp_task_t *runtime_next(struct microtcp_shard *shard){
+    struct microtcp_runtime *rt = shard->rt;
+    microtcp_task_t *task = NULL;
+    int first = 0, i = 0;
+
+    if((task = runtime_accept(shard, &shard->sock, 0)) != NULL) return task;
+    if((task = deque_steal(&shard->deque)) != NULL) return task;
+    if(rt->nshards == 1) return NULL;
+
+    //Thieves start at random so that they don't all go after the same worker
+    first = rand_r(&shard->seed) % rt->nshards;
+    for(i = 0; i < rt->nshards; i++){
+        struct microtcp_shard *victim = &rt->shards[(first + i) % rt->nshards];
+
+        if(victim != shard && (task = deque_steal(&victim->deque)) != NULL) return task;
+    }
+    for(i = 0; i < rt->nshards; i++){
+        struct microtcp_shard *victim = &rt->shards[(first + i) % rt->nshards];
+
+        if(victim != shard && (task = runtime_accept(shard, &victim->sock, 0)) != NULL) return task;
+    }
+    return NULL;
+}
+
+static void task_close(microtcp_task_t *task){
+    microtcp_shutdown(&task->conn, SHUT_RDWR);
+    free(task);
+}
+
+static void *runtime_worker(void *arg){
+    struct microtcp_shard *shard = arg;
+    struct microtcp_runtime *rt = shard->rt;
+    microtcp_task_t *task = NULL;
+
+    while(!atomic_load(&rt->stop)){
+        if((task = runtime_next(shard)) == NULL){
+            //Sleep on our listener, but not for so long that the others' work piles up
+            task = runtime_accept(shard, &shard->sock, rt->nshards == 1 ? -1 : MICROTCP_RUNTIME_IDLE_US);
+            if(task == NULL) continue;
+        }
+        for(;;){
+            if(rt->handler(&task->conn, rt->arg) != MICROTCP_TASK_YIELD || atomic_load(&rt->stop)){
+                task_close(task);
+                break;
+            }
+            //Runs it on while the deque is full, there is no one to hand it over to then
+            if(deque_push(&shard->deque, task) == 0) break;
+        }
+    }
+    return NULL;
+}
+
+/* Sets up the listening socket of a shard, with the options of tmpl if there is one */
+static int shard_listen(struct microtcp_shard *shard, const microtcp_sock_t *tmpl, const struct sockaddr *address, socklen_t address_len, int backlog){
+    int sd = socket(AF_INET, SOCK_DGRAM, 0), on = 1;
+
+    if(sd == -1) return -1;
+    if(setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1){
+        perror("(!) Could not set SO_REUSEPORT");
+        close(sd);
+        return -1;
+    }
+    if(tmpl != NULL) shard->sock = *tmpl;
+    else{
+        shard->sock = microtcp_socket(AF_INET, SOCK_DGRAM, 0);
+        close(shard->sock.sd);
+    }
+    shard->sock.sd = sd;
+    shard->sock.rx_sd = sd;
+    shard->sock.uring = NULL;     //The template's, it stays with it
+    if(microtcp_bind(&shard->sock, address, address_len) == -1 || microtcp_listen(&shard->sock, backlog) == -1){
+        close(sd);
+        return -1;
+    }
+    pin_thread(shard->sock.listener->thread, shard->cpu);
+    return 0;
+}
+
+static void shard_close(struct microtcp_shard *shard){
+    microtcp_shutdown(&shard->sock, SHUT_RDWR);
+    close(shard->sock.sd);
+}
+
+struct microtcp_runtime *microtcp_runtime_start(const struct sockaddr *address, socklen_t address_len, int nworkers, int backlog,
+                                                const microtcp_sock_t *tmpl, microtcp_handler_t handler, void *arg){
+    struct microtcp_runtime *rt = NULL;
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], ncpus = 0, i = 0, err = 0;
+
+    if(handler == NULL){
+        errno = EINVAL;
+        return NULL;
+    }
+    //Workers go round the CPUs we may run on
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return NULL;
+    for(i = 0; i < CPU_SETSIZE; i++)
+        if(CPU_ISSET(i, &allowed)) cpus[ncpus++] = i;
+    if(nworkers <= 0) nworkers = ncpus;
+
+    rt = calloc(1, sizeof(struct microtcp_runtime));
+    if(rt == NULL || (rt->shards = calloc(nworkers, sizeof(struct microtcp_shard))) == NULL){
+        printf("(!) Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    rt->handler = handler;
+    rt->arg = arg;
+    atomic_init(&rt->stop, 0);
+
+    //All the listeners first, workers steal from each other's from the start
+    for(rt->nshards = 0; rt->nshards < nworkers; rt->nshards++){
+        struct microtcp_shard *shard = &rt->shards[rt->nshards];
+
+        shard->rt = rt;
+        shard->cpu = cpus[rt->nshards % ncpus];
+        shard->seed = rt->nshards;
+        atomic_init(&shard->deque.top, 0);
+        atomic_init(&shard->deque.bottom, 0);
+        if(shard_listen(shard, tmpl, address, address_len, backlog) == -1) break;
+    }
+    for(rt->nworkers = 0; rt->nshards == nworkers && rt->nworkers < nworkers; rt->nworkers++){
+        struct microtcp_shard *shard = &rt->shards[rt->nworkers];
+
+        if((err = pthread_create(&shard->worker, NULL, runtime_worker, shard)) != 0){
+            errno = err;
+            break;
+        }
+        pin_thread(shard->worker, shard->cpu);
+    }
+    if(rt->nworkers < nworkers){
+        perror("(!) Could not start the runtime");
+        err = errno;
+        microtcp_runtime_stop(rt);
+        errno = err;
+        return NULL;
+    }
+    return rt;
+}
+
+int microtcp_runtime_stop(struct microtcp_runtime *rt){
+    microtcp_task_t *task = NULL;
+    int i = 0;
+
+    atomic_store(&rt->stop, 1);
+    //The listeners go on demultiplexing, the connections still to be closed wait on them for the peers' answers
+    for(i = 0; i < rt->nshards; i++) listener_abort(rt->shards[i].sock.listener);
+    //Workers steal from every shard, none can go before they have all quit
+    for(i = 0; i < rt->nworkers; i++) pthread_join(rt->shards[i].worker, NULL);
+    //A deque holds the connections of any shard once they were stolen, all go before the first listening socket
+    for(i = 0; i < rt->nshards; i++)
+        while((task = deque_steal(&rt->shards[i].deque)) != NULL) task_close(task);
+    for(i = 0; i < rt->nshards; i++){
+        free(rt->shards[i].spare);
+        shard_close(&rt->shards[i]);
+    }
+    free(rt->shards);
+    free(rt);
+    return 0;
+}
 
-        //Retrieve the data of the header of the received packet
-        memcpy(recv_header, socket->recvbuf, sizeof(microtcp_header_t));
+/*
+ * Readiness of non-blocking sockets. The UDP socket of a connection turns
+ * readable for ACKs and window updates as well, which are no news to the
+ * application, so the datagram that waits at its head is looked at before a
+ * connection is reported readable. What a blocking call would have done
+ * while it waited, sending, taking in ACKs and running the timers, is done
+ * while polling, and a poll waits no longer than the first of the timers.
+ *
+ * microtcp_epoll_wait() keeps a list of the sockets to look at. A socket goes
+ * on it when the kernel reports its file descriptor, which it watches edge
+ * triggered, or when one of its timers runs out, and stays on it for as long
+ * as it is ready, which makes readiness level triggered. The timers of the
+ * set run on a timer wheel.
+ */
+#define EPOLL_BATCH 64
+
+typedef struct microtcp_epitem
+{
+    microtcp_sock_t *socket;
+    uint32_t events;              /* What the caller waits for */
+    void *data;
+    int fd;                       /* In the kernel's set, -1 if none */
+    uint8_t checked;              /* On the check list */
+    microtcp_timer_t timer;       /* Runs out with the first of the socket's timers */
+    struct microtcp_epitem *next;
+    struct microtcp_epitem *check_next;
+} microtcp_epitem_t;
+
+struct microtcp_epoll
+{
+    int epfd;                     /* The kernel's set, with the two below */
+    int timer_fd;                 /* Runs out when the wheel has to run */
+    int check_fd;                 /* Readable while the check list is not empty */
+    microtcp_wheel_t wheel;
+    microtcp_epitem_t *items;
+    microtcp_epitem_t *check;     /* Sockets to look at, oldest first */
+    microtcp_epitem_t *check_tail;
+};
+
+/* Whether a segment is one for rcv_stream(), anything else is an ACK for our_receive() */
+static int seg_for_recv(const microtcp_header_t *header){
+    return header->data_len != 0 || (header->control & MICROTCP_CTRL_FIN) || (header->future_use0 & MICROTCP_OPT_ACK_NOW);
+}
 
+/* Peeks at the header of the next datagram, returns 0 if there is none */
+static int seg_peek(microtcp_sock_t *socket, microtcp_header_t *header){
+    uint8_t prefix = 0;
+    struct iovec iov[2] = { { &prefix, 1 }, { header, sizeof(microtcp_header_t) } };
+    int demux = socket->rx_sd != socket->sd;
+    struct msghdr msg;
+    ssize_t result = 0;
+
+    if(socket->uring != NULL) return uring_peek(socket, header);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = demux ? iov : iov + 1;
+    msg.msg_iovlen = demux ? 2 : 1;
+    while((result = recvmsg(socket->rx_sd, &msg, MSG_PEEK | MSG_DONTWAIT)) >= 0){
+        if(result >= demux + (ssize_t)sizeof(microtcp_header_t)) return 1;
+        //Too short to be ours, it would keep the socket readable
+        recv(socket->rx_sd, &prefix, 1, MSG_DONTWAIT);
+    }
+    return 0;
+}
 
-        //!TEST TO SEE IF DUP_ACKS WORK!
-        // if(recv_header->seq_number == 5497){
-        //     checksum_num = 0;
-        //     retrieved_checksum = 0;
-        //     memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
-        //     continue;
-        // }
-        
-        socket->buf_fill_level += (size_t)recv_header->data_len; //Data added to recv_buff
+/* Whether microtcp_recv() has data or the peer's FIN to take */
+static int rcv_pending(microtcp_sock_t *socket){
+    microtcp_header_t header;
 
-        //Copy data to our temp buffer
+    if(socket->rcv_leftover_len != 0 || socket->stash_len != 0) return 1;
+    return seg_peek(socket, &header) && seg_for_recv(&header);
+}
 
-        char **buffer_msg = malloc(recv_header->data_len);
-        memset(buffer_msg, 0, recv_header->data_len);
-        if(buffer_msg == NULL){
-            printf("(!) Memory allocation failed!\n");
-            exit(EXIT_FAILURE);
+/*
+ * Sends what the windows allow, takes in the ACKs and runs the timers that
+ * ran out, without blocking. A failure is kept for sock_events().
+ */
+static void sock_progress(microtcp_sock_t *socket){
+    microtcp_header_t header;
+
+    if(socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER) return;
+    if(socket->cork_len <= snd_space(socket) && cork_due(socket) && cork_flush(socket, 0) == -1)
+        socket->poll_error = errno;
+    if(snd_pending(socket) && snd_pump(socket, 0, 0) == -1) socket->poll_error = errno;
+    //With nothing in flight snd_pump() leaves the socket alone, window updates would pile up in front of the data
+    while(!snd_pending(socket) && socket->stash_len == 0 && seg_peek(socket, &header) && !seg_for_recv(&header)){
+        our_receive(socket, 0, 1);
+        socket->duplicate_ack_count = 0;
+    }
+    if(socket->delack_pending && microtcp_ts_now() - socket->delack_ts >= MICROTCP_DELACK_TIMEOUT_US){
+        socket->pingpong = 0;
+        if(our_send(socket, NULL, 0, 0) == -1) socket->poll_error = errno;
+    }
+}
+
+/* POLLIN, POLLOUT and the rest by the protocol's state */
+static short sock_events(microtcp_sock_t *socket){
+    short events = socket->poll_error != 0 ? POLLERR : 0;
+    size_t space = snd_space(socket);
+
+    switch(socket->state){
+    case LISTEN:
+        pthread_mutex_lock(&socket->listener->lock);
+        if(socket->listener->queue_count != 0) events |= POLLIN;
+        pthread_mutex_unlock(&socket->listener->lock);
+        return events;
+    case ESTABLISHED:
+        if(rcv_pending(socket)) events |= POLLIN;
+        if(space > socket->cork_len && space - socket->cork_len >= min(socket->sndlowat, socket->sndbuf_max)) events |= POLLOUT;
+        return events;
+    case CLOSING_BY_PEER:
+        return events | POLLIN | POLLRDHUP;
+    default:
+        return events | POLLHUP;
+    }
+}
+
+/* Microseconds until the first of the socket's timers runs out, 0 if none runs */
+static uint32_t sock_timer(microtcp_sock_t *socket){
+    microtcp_sndq_t *q = &socket->snd;
+    uint32_t now = microtcp_ts_now(), next = UINT32_MAX, pto = 0;
+
+    if(socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER) return 0;
+    if(socket->delack_pending) next = min(next, timer_left(now, socket->delack_ts, MICROTCP_DELACK_TIMEOUT_US));
+    if(socket->cork_len != 0) next = min(next, timer_left(now, socket->cork_ts, cork_timeout(socket)));
+    if(q->una < q->next){
+        next = min(next, timer_left(now, q->rto_start, socket->rto_us));
+        if(q->reo_armed) next = min(next, seq_before(now, q->reo_deadline) ? q->reo_deadline - now : 1);
+        pto = tlp_timeout(socket, q->next - q->una);
+        if(pto != 0 && !q->tlp_sent && q->next == q->built && q->built_len == q->len)
+            next = min(next, timer_left(now, socket->last_xmit_ts, pto));
+        //The rate limit may hold the next segment back
+        if(socket->tb_rate != 0 && (q->next < q->built || q->built_len < q->len)) next = min(next, MICROTCP_WHEEL_TICK_US);
+    }
+    //Nothing in flight but data to send, the peer's window is closed or the rate limit holds it back
+    else if(snd_pending(socket))
+        next = min(next, q->persist_us != 0 && seq_before(now, q->persist_deadline) ? q->persist_deadline - now : MICROTCP_WHEEL_TICK_US);
+    return next == UINT32_MAX ? 0 : next;
+}
+
+/* The file descriptor that turns readable when the socket may have news, -1 if none does */
+static int sock_fd(microtcp_sock_t *socket){
+    if(socket->state == LISTEN) return socket->listener->ready_fd;
+    if(socket->state == ESTABLISHED || socket->state == CLOSING_BY_PEER) return rx_fd(socket);
+    return -1;
+}
+
+static int sock_pollable(microtcp_sock_t *socket){
+    return socket->engine == NULL && (socket->state != LISTEN || socket->listener != NULL);
+}
+
+int microtcp_poll(microtcp_pollfd_t *fds, nfds_t nfds, int timeout){
+    struct pollfd *pfds = calloc(max(nfds, 1), sizeof(struct pollfd));
+    uint64_t deadline = now_ns() + (uint64_t)max(timeout, 0) * 1000000, now = 0;
+    uint32_t wait_us = 0, next = 0;
+    short events = 0;
+    int ready = 0;
+    nfds_t i = 0;
+
+    if(pfds == NULL){
+        errno = ENOMEM;
+        return -1;
+    }
+    while(1){
+        ready = 0;
+        wait_us = UINT32_MAX;
+        for(i = 0; i < nfds; i++){
+            fds[i].revents = 0;
+            pfds[i].fd = -1;
+            pfds[i].events = POLLIN;
+            if(fds[i].socket == NULL) continue;
+            if(!sock_pollable(fds[i].socket)){
+                fds[i].revents = POLLNVAL;
+                ready++;
+                continue;
+            }
+            sock_progress(fds[i].socket);
+            events = sock_events(fds[i].socket);
+            fds[i].revents = events & (fds[i].events | POLLERR | POLLHUP);
+            if(fds[i].revents != 0) ready++;
+            if((next = sock_timer(fds[i].socket)) != 0) wait_us = min(wait_us, next);
+            //Unread data keeps its file descriptor readable, only a timer has news then
+            if(!(events & POLLIN)) pfds[i].fd = sock_fd(fds[i].socket);
+        }
+        if(ready != 0 || timeout == 0) break;
+        now = now_ns();
+        if(timeout > 0){
+            if(now >= deadline) break;
+            wait_us = min(wait_us, (deadline - now + 999) / 1000);
         }
-        if(recv_header->data_len != 0){
-            memcpy(buffer_msg, socket->recvbuf + sizeof(microtcp_header_t), recv_header->data_len);
+        if(poll(pfds, nfds, wait_us == UINT32_MAX ? -1 : (int)((wait_us + 999) / 1000)) == -1){
+            ready = -1;
+            break;
         }
+    }
+    free(pfds);
+    return ready;
+}
 
-        //Check if checksum is correct
-        retrieved_checksum = recv_header->checksum;
-        recv_header->checksum = 0;
-        packet_size = sizeof(microtcp_header_t) + recv_header->data_len;
-        memset(socket->recvbuf, 0, packet_size);
-        memcpy(socket->recvbuf, recv_header, sizeof(microtcp_header_t));
-        if(recv_header->data_len != 0)
-            memcpy(socket->recvbuf + sizeof(microtcp_header_t), buffer_msg, recv_header->data_len);
-        checksum_num = crc32(socket->recvbuf, packet_size);
+/* Puts the item on the check list, unless it is there already */
+static void ep_check(struct microtcp_epoll *ep, microtcp_epitem_t *item){
+    if(item->checked) return;
+    item->checked = 1;
+    item->check_next = NULL;
+    if(ep->check == NULL){
+        ep->check = item;
+        eventfd_write(ep->check_fd, 1);
+    }
+    else ep->check_tail->check_next = item;
+    ep->check_tail = item;
+}
 
+static void ep_timeout(microtcp_timer_t *timer, void *arg){
+    ep_check(arg, (microtcp_epitem_t *)((char *)timer - offsetof(microtcp_epitem_t, timer)));
+}
 
-        //CHECK ACK_NUMBERS && SEQUENCE_NUMBERS
-        if(retrieved_checksum != checksum_num){
-            perror("(!) Package has not been received correctly!\n");
-            continue;
-        }
+static microtcp_epitem_t *ep_find(struct microtcp_epoll *ep, microtcp_sock_t *socket, microtcp_epitem_t ***pprev){
+    microtcp_epitem_t **p = &ep->items;
 
-        //CHECK IF THAT WORKS
-        if(recv_header->seq_number != socket->ack_number){
-            if(our_send(socket, NULL, 0, flags) == -1){
-                printf("(!) Error sending ACK packet!\n");
-            }
-            checksum_num = 0;
-            retrieved_checksum = 0;
-            memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
-            free(buffer_msg);
-            perror("(!) Package has not been received correctly!\n");
-            continue;
+    while(*p != NULL && (*p)->socket != socket) p = &(*p)->next;
+    if(pprev != NULL) *pprev = p;
+    return *p;
+}
+
+/* Arms timer_fd for the first timer of the wheel */
+static void ep_arm(struct microtcp_epoll *ep){
+    struct itimerspec its;
+    int timeout = wheel_timeout(&ep->wheel);
+
+    memset(&its, 0, sizeof(its));
+    if(timeout == 0) its.it_value.tv_nsec = 1;
+    else if(timeout > 0){
+        its.it_value.tv_sec = timeout / 1000;
+        its.it_value.tv_nsec = (long)(timeout % 1000) * 1000000;
+    }
+    timerfd_settime(ep->timer_fd, 0, &its, NULL);
+}
+
+/*
+ * Looks at the sockets of the check list once. Those that are ready are
+ * reported, at most maxevents of them, and go to the back of the list for the
+ * next time, the others leave it until the kernel or a timer puts them back.
+ */
+static int ep_scan(struct microtcp_epoll *ep, microtcp_epoll_event_t *events, int maxevents){
+    microtcp_epitem_t *item = NULL, *last = ep->check_tail;
+    uint32_t ready = 0, next = 0;
+    int n = 0, more = ep->check != NULL;
+
+    while(more && n < maxevents){
+        item = ep->check;
+        more = item != last;
+        ep->check = item->check_next;
+        if(ep->check == NULL) ep->check_tail = NULL;
+        item->checked = 0;
+
+        sock_progress(item->socket);
+        ready = sock_events(item->socket) & (item->events | EPOLLERR | EPOLLHUP);
+        if((next = sock_timer(item->socket)) != 0) timer_arm(&ep->wheel, &item->timer, next);
+        else timer_cancel(&ep->wheel, &item->timer);
+        if(ready != 0){
+            events[n].events = ready;
+            events[n].data = item->data;
+            n++;
+            ep_check(ep, item);
         }
+    }
+    if(ep->check == NULL) eventfd_read(ep->check_fd, &(eventfd_t){0});
+    return n;
+}
 
-        printf("Package received correctly\n");
-        printf("Package - checksum: %d\n",recv_header->checksum);
-        printf("Package - future_use0: %d\n",recv_header->future_use0);
-        printf("Package - future_use1: %d\n",recv_header->future_use1);
-        printf("Package - future_use2: %d\n",recv_header->future_use2);
-        printf("Package - ack_number: %d\n",recv_header->ack_number);
-        printf("Package - seq_number: %d\n",recv_header->seq_number);
-        printf("Package - control: %d\n",recv_header->control);
-        printf("Package - data_len: %d\n",recv_header->data_len);
-        printf("Package - window: %d\n",recv_header->window);
-        printf("\n\n");
+struct microtcp_epoll *microtcp_epoll_create(void){
+    struct microtcp_epoll *ep = calloc(1, sizeof(struct microtcp_epoll));
+    struct epoll_event ev = { EPOLLIN, { 0 } };
 
-        //If message is FIN_ACK
-        if(recv_header->control == 0b0000000000001001){ //FIN_ACK
-            printf("(!) Connection closed by peer!\n");
-            socket->state = CLOSING_BY_PEER;
+    if(ep == NULL){
+        errno = ENOMEM;
+        return NULL;
+    }
+    ev.data.ptr = ep;
+    ep->epfd = epoll_create1(EPOLL_CLOEXEC);
+    ep->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    ep->check_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(ep->epfd == -1 || ep->timer_fd == -1 || ep->check_fd == -1 ||
+       epoll_ctl(ep->epfd, EPOLL_CTL_ADD, ep->timer_fd, &ev) == -1 ||
+       epoll_ctl(ep->epfd, EPOLL_CTL_ADD, ep->check_fd, &ev) == -1){
+        perror("(!) Could not create the epoll set");
+        if(ep->epfd != -1) close(ep->epfd);
+        if(ep->timer_fd != -1) close(ep->timer_fd);
+        if(ep->check_fd != -1) close(ep->check_fd);
+        free(ep);
+        return NULL;
+    }
+    wheel_init(&ep->wheel);
+    return ep;
+}
+
+int microtcp_epoll_ctl(struct microtcp_epoll *ep, int op, microtcp_sock_t *socket, uint32_t events, void *data){
+    microtcp_epitem_t *item = NULL, **pprev = NULL, *prev = NULL;
+    struct epoll_event ev = { EPOLLIN | EPOLLET, { 0 } };
+
+    if(!sock_pollable(socket)){
+        errno = EINVAL;
+        return -1;
+    }
+    item = ep_find(ep, socket, &pprev);
+    switch(op){
+    case EPOLL_CTL_ADD:
+        if(item != NULL){
+            errno = EEXIST;
+            return -1;
+        }
+        if((item = calloc(1, sizeof(microtcp_epitem_t))) == NULL){
+            errno = ENOMEM;
+            return -1;
+        }
+        item->socket = socket;
+        item->fd = sock_fd(socket);
+        ev.data.ptr = item;
+        if(item->fd != -1 && epoll_ctl(ep->epfd, EPOLL_CTL_ADD, item->fd, &ev) == -1){
+            free(item);
             return -1;
         }
+        timer_init(&item->timer, ep_timeout, ep);
+        item->next = ep->items;
+        ep->items = item;
+        break;
+    case EPOLL_CTL_MOD:
+        if(item == NULL){
+            errno = ENOENT;
+            return -1;
+        }
+        break;
+    case EPOLL_CTL_DEL:
+        if(item == NULL){
+            errno = ENOENT;
+            return -1;
+        }
+        *pprev = item->next;
+        if(item->checked){
+            if(ep->check != item)
+                for(prev = ep->check; prev->check_next != item; prev = prev->check_next) ;
+            if(prev == NULL) ep->check = item->check_next;
+            else prev->check_next = item->check_next;
+            if(ep->check_tail == item) ep->check_tail = prev;
+            if(ep->check == NULL) eventfd_read(ep->check_fd, &(eventfd_t){0});
+        }
+        timer_cancel(&ep->wheel, &item->timer);
+        //Closed along with the socket, the kernel dropped it from the set already
+        if(item->fd != -1) epoll_ctl(ep->epfd, EPOLL_CTL_DEL, item->fd, NULL);
+        free(item);
+        return 0;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    item->events = events;
+    item->data = data;
+    ep_check(ep, item);
+    return 0;
+}
 
-        data_received += recv_header->data_len;
+int microtcp_epoll_wait(struct microtcp_epoll *ep, microtcp_epoll_event_t *events, int maxevents, int timeout){
+    struct epoll_event kev[EPOLL_BATCH];
+    uint64_t deadline = now_ns() + (uint64_t)max(timeout, 0) * 1000000, now = 0, left = 0;
+    int n = 0, nk = 0, i = 0, wait = 0;
 
-        socket->curr_win_size = recv_header->window;
+    if(maxevents <= 0){
+        errno = EINVAL;
+        return -1;
+    }
+    while(1){
+        do{
+            if((nk = epoll_wait(ep->epfd, kev, EPOLL_BATCH, wait)) == -1){
+                ep_arm(ep);
+                return -1;
+            }
+            for(i = 0; i < nk; i++){
+                if(kev[i].data.ptr != ep) ep_check(ep, kev[i].data.ptr);
+                else read(ep->timer_fd, &(uint64_t){0}, sizeof(uint64_t));
+            }
+            wait = 0;
+        }while(nk == EPOLL_BATCH);
+        wheel_run(&ep->wheel);
+        if((n = ep_scan(ep, events, maxevents)) != 0 || timeout == 0) break;
+
+        wait = wheel_timeout(&ep->wheel);
+        if(timeout > 0){
+            now = now_ns();
+            if(now >= deadline) break;
+            left = (deadline - now + 999999) / 1000000;
+            wait = wait == -1 ? (int)left : (int)min((uint64_t)wait, left);
+        }
+    }
+    ep_arm(ep);
+    return n;
+}
 
-        socket->ack_number = recv_header->seq_number + recv_header->data_len;
+int microtcp_epoll_fd(struct microtcp_epoll *ep){
+    return ep->epfd;
+}
 
-        //Send acknowledgement
-            memset(ack_header,0,sizeof(microtcp_header_t));
+void microtcp_epoll_close(struct microtcp_epoll *ep){
+    microtcp_epitem_t *item = NULL;
 
-            // socket->seq_number = recv_header->seq_number + recv_header->data_len;
+    while((item = ep->items) != NULL){
+        ep->items = item->next;
+        free(item);
+    }
+    close(ep->epfd);
+    close(ep->timer_fd);
+    close(ep->check_fd);
+    free(ep);
+}
 
-            ack_header->data_len = 0;
-            ack_header->ack_number = socket->ack_number;
-            ack_header->seq_number = socket->seq_number;
-            ack_header->future_use0 = 0;
-            ack_header->future_use1 = 0;
-            ack_header->future_use2 = 0;
-            ack_header->window = socket->init_win_size - socket->buf_fill_level;
-            ack_header->checksum = 0;
-            ack_header->control = 0b0000000000001000; //Ack 
+ssize_t min_for3(size_t a, size_t b, size_t c){
+	return min(a,min(b,c));
+}
 
+/*
+ * Pacing. Spaces out data segments at the rate given by the application or
+ * the congestion control, or else at cwnd/SRTT with some headroom so that
+ * cwnd can still grow. Returns the departure time of the segment if the
+ * kernel is going to hold it (SO_TXTIME), otherwise sleeps until it is due
+ * and returns 0.
+ */
+static uint64_t pacing_wait(microtcp_sock_t *socket, size_t packet_size){
+    uint64_t rate = socket->pacing_rate, now = 0, departure = 0;
 
-            
-            
-            memcpy(socket->sendbuf, ack_header, sizeof(microtcp_header_t));
-            checksum_num = crc32(socket->sendbuf, sizeof(microtcp_header_t));
-            ack_header->checksum = checksum_num;
-            memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
-            memcpy(socket->sendbuf, ack_header, sizeof(microtcp_header_t));
-            //Sending ACK 
-            if(socket->client_ip == NULL){
-                
-                if(sendto(socket->sd, socket->sendbuf, sizeof(microtcp_header_t), 0, socket->server_ip, sizeof(*(socket->server_ip))) == -1){
-                    perror("(!) COULD NOT SENT ACK PACKET!\n");
-                    return -1;
-                }
-                else printf("SENT ACK PACKAGE!\n\n");
-            }else{
-                if(sendto(socket->sd, socket->sendbuf, sizeof(microtcp_header_t), 0, (struct sockaddr *)socket->client_ip,sizeof(*(socket->client_ip))) == -1){
-                    perror("(!) COULD NOT SENT ACK PACKET!\n");
-                    return -1;
-                }
-                else printf("SENT ACK PACKAGE!\n\n");
-            }
+    if(rate == 0 && socket->srtt_us != 0){
+        rate = (uint64_t)socket->cwnd * 1000000 / socket->srtt_us;
+        rate = rate * (socket->cwnd < socket->ssthresh ? MICROTCP_PACING_SS_GAIN : MICROTCP_PACING_CA_GAIN) / 100;
+    }
+    if(rate == 0) return 0;
 
-        if(recv_header->data_len == 0){
-            memset(socket->recvbuf, 0, MICROTCP_RECVBUF_LEN);
-            socket->buf_fill_level = 0;
-            checksum_num = 0;
-            retrieved_checksum = 0;
-            memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
-            memset(recv_header, 0, sizeof(microtcp_header_t));
-            packet_size = sizeof(microtcp_header_t) + length - data_received;
-            free(buffer_msg);
-            continue;
-        }
-        // When our rwnd is "0" (leave 32 bytes for the incoming empty probes)
-        // if(socket->init_win_size - socket->buf_fill_level == 32){
-        //     //copy data to users_buffer
-        //     if(length >= data_received){
-        
-                // length -= MICROTCP_RECVBUF_LEN - 32;
-        //     }
-        //     else{
-        //         printf("(!)Not enough space in user's buffer to accomodate data.\n");
-        //         return -1;
-        //     }
-        //     socket->buf_fill_level = socket->buf_fill_level - sizeof(microtcp_header_t) - (size_t)recv_header->data_len;
+    now = now_ns();
+    departure = max(now, socket->pacing_next_ns);
+    socket->pacing_next_ns = departure + packet_size * 1000000000 / rate;
 
-        // }
+    if(socket->pacing == MICROTCP_PACING_TXTIME) return departure;
 
-        
-        
-        //Return data to user and release from recv_buff
+    if(departure > now + MICROTCP_PACING_SLACK_NS){
+        struct timespec ts = { departure / 1000000000, departure % 1000000000 };
+        //What the burst queued in the ring is due already
+        if(socket->uring != NULL) uring_flush(socket->uring);
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    }
+    return 0;
+}
 
+/*
+ * Sends a datagram to the peer, attaching its departure time when the kernel
+ * paces it, and ECT(0) when the socket is shared with other connections. A
+ * PLPMTUD probe is not queued behind others, EMSGSIZE has to reach the caller.
+ */
+static ssize_t our_sendto(microtcp_sock_t *socket, const void *packet, size_t packet_size, int flags, uint64_t txtime, int probe){
+    struct sockaddr *addr = NULL;
+    socklen_t addrlen = 0;
+    int mark = socket->ecn_ok && socket->rx_sd != socket->sd;
 
-        checksum_num = 0;
-        retrieved_checksum = 0;
-        memset(socket->sendbuf, 0, sizeof(microtcp_header_t));
-        free(buffer_msg);
-        break;
+    /*Server sends a package!*/
+    if(socket->server_ip == NULL){
+        addr = (struct sockaddr *)socket->client_ip;
+        addrlen = sizeof(*(socket->client_ip));
+    }/*Client sends a package*/
+    else{
+        addr = socket->server_ip;
+        addrlen = sizeof(*(socket->server_ip));
     }
-    
-    memcpy(buffer, socket->recvbuf + sizeof(microtcp_header_t), data_received);
-    // memset(socket->recvbuf, 0, socket->buf_fill_level);
-    // socket->buf_fill_level = 0;
-    free(recv_header);
-    free(ack_header);
-    free(socket->sendbuf);
 
-    
-    return data_received;
+    if(txtime != 0 || mark || socket->uring != NULL){
+        char control[CMSG_SPACE(sizeof(uint64_t)) + CMSG_SPACE(sizeof(int))];
+        struct iovec iov = { (void *)packet, packet_size };
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        size_t controllen = 0;
+        int tos = MICROTCP_ECN_ECT0;
+
+        memset(&msg, 0, sizeof(msg));
+        memset(control, 0, sizeof(control));
+        msg.msg_name = addr;
+        msg.msg_namelen = addrlen;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if(txtime != 0){
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_TXTIME;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+            memcpy(CMSG_DATA(cmsg), &txtime, sizeof(uint64_t));
+            controllen += CMSG_SPACE(sizeof(uint64_t));
+            cmsg = (struct cmsghdr *)(control + controllen);
+        }
+        if(mark){
+            cmsg->cmsg_level = IPPROTO_IP;
+            cmsg->cmsg_type = IP_TOS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &tos, sizeof(int));
+            controllen += CMSG_SPACE(sizeof(int));
+        }
+        msg.msg_controllen = controllen;
+        if(socket->uring != NULL) return uring_sendmsg(socket, &msg, flags, probe);
+        return sendmsg(socket->sd, &msg, flags);
+    }
+    return sendto(socket->sd, packet, packet_size, flags, addr, addrlen);
 }
 
-ssize_t min_for3(size_t a, size_t b, size_t c){
-	return min(a,min(b,c));
+uint32_t microtcp_ts_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
 }
 
 ssize_t our_send(microtcp_sock_t *socket, const void *buffer, size_t length, int flags){
-    size_t packet_size = sizeof(microtcp_header_t) + length;
+    ssize_t result = our_send_seq(socket, socket->seq_number, buffer, length, flags);
+
+    if(result != -1) socket->seq_number += length;
+    return result;
+}
+
+ssize_t our_send_seq(microtcp_sock_t *socket, uint32_t seq_number, const void *buffer, size_t length, int flags){
+    size_t pad = length != 0 ? socket->xmit_pad : 0;   //A PLPMTUD probe goes out at the probed size
+    size_t packet_size = sizeof(microtcp_header_t) + max(length, pad);
     uint32_t checksum_num = 0, retrieved_checksum;
     microtcp_header_t *send_header = malloc(sizeof(microtcp_header_t));
+    uint8_t *packet = NULL;
+    uint64_t txtime = 0;
 
     printf("in our send\n");
+    socket->xmit_pad = 0;
     
     if(send_header == NULL){
         printf("(!) Memory allocation failed!\n");
         exit(EXIT_FAILURE);
     }
  
+    if(socket->pacing != MICROTCP_PACING_OFF && length != 0) txtime = pacing_wait(socket, packet_size);
+    socket->last_xmit_ts = txtime != 0 ? (uint32_t)(txtime / 1000) : microtcp_ts_now();
     send_header->data_len = length;
     send_header->ack_number = socket->ack_number;
-    send_header->seq_number = socket->seq_number;
-    send_header->future_use0 = 0;
-    send_header->future_use1 = 0;
-    send_header->future_use2 = 0;
-    send_header->window = socket->init_win_size - socket->buf_fill_level;
+    send_header->seq_number = seq_number;
+    send_header->future_use0 = conn_id_opt(socket);
+    if(length != 0){
+        //Data that answers what just arrived carries its ACK, keep delaying ACKs for that.
+        //An ACK that was held past its timer means we answer too slowly for it
+        if(socket->last_data_rcv_ts != 0 && socket->last_xmit_ts - socket->last_data_rcv_ts < MICROTCP_DELACK_TIMEOUT_US)
+            socket->pingpong = 1;
+        if(socket->delack_pending && socket->last_xmit_ts - socket->delack_ts >= MICROTCP_DELACK_TIMEOUT_US)
+            socket->pingpong = 0;
+        send_header->future_use0 |= socket->ack_freq;
+        if(socket->ack_now_pending) send_header->future_use0 |= MICROTCP_OPT_ACK_NOW;
+        socket->ack_now_pending = 0;
+    }
+    //An empty segment that wants an answer is a window probe
+    else if(socket->ack_now_pending){
+        send_header->future_use0 |= MICROTCP_OPT_ACK_NOW;
+        socket->ack_now_pending = 0;
+    }
+    send_header->future_use1 = socket->last_xmit_ts;
+    send_header->future_use2 = socket->ts_recent;
+    send_header->window = rcv_window(socket);
     send_header->checksum = 0;
     send_header->control = 0b0000000000001000;   //ACK
+    if(socket->ecn_ce_pending) send_header->control |= MICROTCP_CTRL_ECE;
+    if(socket->ecn_cwr_pending && length != 0){
+        send_header->control |= MICROTCP_CTRL_CWR;
+        socket->ecn_cwr_pending = 0;
+    }
 
-    socket->sendbuf = malloc(packet_size);
-    if(socket->sendbuf == NULL){
+    //Use our own packet buffer, socket->sendbuf may be in use by the caller
+    packet = malloc(packet_size);
+    if(packet == NULL){
         printf("(!) Memory allocation failed!\n");
         exit(EXIT_FAILURE);
     }
     /*Create checksum number and add to the packet*/
-    memset(socket->sendbuf, 0, packet_size);
-    memcpy(socket->sendbuf, send_header, sizeof(microtcp_header_t));    //Add header
+    memset(packet, 0, packet_size);
+    memcpy(packet, send_header, sizeof(microtcp_header_t));    //Add header
     if(buffer != NULL && length != 0){
-        memcpy(socket->sendbuf + sizeof(microtcp_header_t), (char *)buffer, length);      //Add data
+        memcpy(packet + sizeof(microtcp_header_t), (char *)buffer, length);      //Add data
     }
-    checksum_num = crc32(socket->sendbuf, packet_size);
+    checksum_num = crc32(packet, sizeof(microtcp_header_t) + length);   //The padding is not covered
     send_header->checksum = checksum_num;
-    memset(socket->sendbuf, 0, packet_size);
-    memcpy(socket->sendbuf, send_header, sizeof(microtcp_header_t));    //Add header
+    memset(packet, 0, packet_size);
+    memcpy(packet, send_header, sizeof(microtcp_header_t));    //Add header
     if(buffer != NULL && length != 0){
-        memcpy(socket->sendbuf + sizeof(microtcp_header_t), (char *)buffer, length);      //Add data
+        memcpy(packet + sizeof(microtcp_header_t), (char *)buffer, length);      //Add data
     }
-    /*Server sends a package!*/
-    if(socket->server_ip == NULL){
-        if(sendto(socket->sd, socket->sendbuf, packet_size, flags, (struct sockaddr *)socket->client_ip, sizeof(*(socket->client_ip))) == -1){
-            perror("(!) COULD NOT SEND PACKET!\n");
-            return -1;
-        }
-        
-    }/*Client sends a package*/
-    else{
-        if(sendto(socket->sd, socket->sendbuf, packet_size, flags, socket->server_ip, sizeof(*(socket->server_ip))) == -1){
-            perror("(!) COULD NOT SEND PACKET!\n");
-            return -1;
-        }
+    if(our_sendto(socket, packet, packet_size, flags, txtime, pad != 0) == -1){
+        perror("(!) COULD NOT SEND PACKET!\n");
+        free(send_header);
+        free(packet);
+        return -1;
     }
     printf("SENT PACKAGE\n");
-    socket->seq_number += send_header->data_len;
+    socket->delack_pending = 0;     //Our ack_number went out with it
 
     free(send_header);
-    free(socket->sendbuf);
+    free(packet);
 
     return length;
 }
 
 
-ssize_t our_receive(microtcp_sock_t* socket, int flags){
+/* RFC 6298 RTT estimation, fed with timestamp echoes */
+static void update_rtt(microtcp_sock_t *socket, uint32_t rtt_us){
+    if(rtt_us == 0) rtt_us = 1;
+
+    if(socket->srtt_us == 0){
+        socket->srtt_us = rtt_us;
+        socket->rttvar_us = rtt_us / 2;
+        socket->min_rtt_us = rtt_us;
+    }
+    else{
+        socket->rttvar_us = (3 * socket->rttvar_us + (socket->srtt_us > rtt_us ? socket->srtt_us - rtt_us : rtt_us - socket->srtt_us)) / 4;
+        socket->srtt_us = (7 * socket->srtt_us + rtt_us) / 8;
+        if(rtt_us < socket->min_rtt_us) socket->min_rtt_us = rtt_us;
+    }
+}
+
+/*
+ * Keeps a segment with data or a FIN for the next microtcp_recv(), as long
+ * as it is the next one we expect. The header keeps the checksum it came with.
+ */
+static void stash_segment(microtcp_sock_t *socket, const microtcp_header_t *header, const uint8_t *data, uint8_t tos){
+    if(socket->stash_len != 0 || header->seq_number != socket->ack_number) return;
+    if(socket->stash == NULL && (socket->stash = malloc(sizeof(microtcp_header_t) + MICROTCP_MAX_MSS)) == NULL){
+        printf("(!) Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(socket->stash, header, sizeof(microtcp_header_t));
+    memcpy(socket->stash + sizeof(microtcp_header_t), data, header->data_len);
+    socket->stash_len = sizeof(microtcp_header_t) + header->data_len;
+    socket->stash_tos = tos;
+}
+
+ssize_t our_receive(microtcp_sock_t* socket, int flags, uint32_t timeout_us){
     microtcp_header_t *recv_ack_header = malloc(sizeof(microtcp_header_t));
-    size_t packet_size = sizeof(microtcp_header_t);
+    size_t packet_size = sizeof(microtcp_header_t) + socket->local_mss;
     int result = 0;
-    uint32_t checksum_num = 0, retrieved_checksum = 0;
+    uint32_t checksum_num = 0, retrieved_checksum = 0, now = 0;
+    uint8_t tos = 0;
 
      printf("in our receive\n");
 
@@ -1059,46 +4728,38 @@ ssize_t our_receive(microtcp_sock_t* socket, int flags){
         exit(EXIT_FAILURE);
     }
 
-    socklen_t addrlen = sizeof(*(socket->client_ip));
-
-    struct timeval timeout;
-    timeout. tv_sec = 0;
-    timeout. tv_usec = MICROTCP_ACK_TIMEOUT_US;
-    if (setsockopt( socket->sd , SOL_SOCKET, SO_RCVTIMEO , & timeout , sizeof( struct timeval)) < 0) {
-        perror(" setsockopt");
-        return -2;
-    }
-    /*Server receives a package!*/
-    if(socket->server_ip == NULL){
-        if((result = recvfrom(socket->sd, socket->recvbuf, packet_size, 0, (struct sockaddr *)socket->client_ip, &addrlen)) < 0){ //SYN
-            perror("(!) COULD NOT RECEIVE PACKET!\n");
-            return result;
-        }
-        else printf("RECEIVED PACKAGE YAY!\n");
-        
-        
-    }/*Client receive a package*/
-    else{
-        if((result = recvfrom(socket->sd, socket->recvbuf, packet_size, 0, socket->server_ip, &addrlen) < 0)){ //SYN
-            perror("(!) COULD NOT RECEIVE PACKET!\n");
-            return result;
-        }
-        else printf("RECEIVED PACKAGE YAY!\n");
+    if(timeout_us == 0) timeout_us = 1;
+    set_recv_timeout(socket, timeout_us);
+    result = our_recvfrom(socket, socket->recvbuf, packet_size, &tos);
+    if(result < 0){
+        free(recv_ack_header);
+        if(errno == EAGAIN || errno == EWOULDBLOCK) return -2;   //timeout
+        perror("(!) COULD NOT RECEIVE PACKET!\n");
+        return -1;
     }
+    else printf("RECEIVED PACKAGE YAY!\n");
 
     //Retrieve the data of the header of the received packet
     memcpy(recv_ack_header, socket->recvbuf, sizeof(microtcp_header_t));
 
-    //Check if checksum is correct
+    //Check if checksum is correct, the peer's data may come along with the ACK
     retrieved_checksum = recv_ack_header->checksum;
     recv_ack_header->checksum = 0;
-    memset(socket->recvbuf, 0, sizeof(microtcp_header_t));
     memcpy(socket->recvbuf, recv_ack_header, sizeof(microtcp_header_t));
-    checksum_num = crc32(socket->recvbuf, sizeof(microtcp_header_t));
+    checksum_num = 0;
+    if(sizeof(microtcp_header_t) + (size_t)recv_ack_header->data_len <= (size_t)result)
+        checksum_num = crc32(socket->recvbuf, sizeof(microtcp_header_t) + recv_ack_header->data_len);
 
     //CHECK ACK_NUMBERS && SEQUENCE_NUMBERS
     if(retrieved_checksum != checksum_num){
         perror("(!) Package has not been received correctly!\n");
+        free(recv_ack_header);
+        return -1;
+    }
+    //The ACK that ended our handshake got lost and the server sent its SYN_ACK again
+    if(recv_ack_header->control & MICROTCP_CTRL_SYN){
+        our_send(socket, NULL, 0, flags);
+        free(recv_ack_header);
         return -1;
     }
     printf("Package received ACK correctly\n");
@@ -1113,21 +4774,45 @@ ssize_t our_receive(microtcp_sock_t* socket, int flags){
     printf("Package - window: %d\n",recv_ack_header->window);
     printf("\n\n");
 
-    if(socket->last_ack_number == recv_ack_header->ack_number && recv_ack_header->window != 0){
+    /* The echoed timestamp gives an RTT sample and tells RACK when the
+     * most recently delivered segment was sent */
+    socket->ts_echo = recv_ack_header->future_use2;
+    if(socket->ts_echo != 0){
+        now = microtcp_ts_now();
+        update_rtt(socket, now - socket->ts_echo);
+        if(socket->rack_xmit_ts == 0 || !seq_before(socket->ts_echo, socket->rack_xmit_ts)){
+            socket->rack_xmit_ts = socket->ts_echo;
+            socket->rack_rtt_us = now - socket->ts_echo;
+        }
+    }
+    /* Echoed in our data, it gives the receiver its RTT for auto-tuning */
+    if(recv_ack_header->future_use1 != 0) socket->ts_recent = recv_ack_header->future_use1;
+    socket->curr_win_size = (size_t)recv_ack_header->window << socket->snd_wscale;
+    if(recv_ack_header->control & MICROTCP_CTRL_ECE) socket->ecn_echo = 1;
+
+    /* Data or a FIN the peer sent along with its ACK is kept for the next
+     * microtcp_recv(), as long as it is the next segment we expect */
+    if(recv_ack_header->data_len != 0 || (recv_ack_header->control & MICROTCP_CTRL_FIN)){
+        recv_ack_header->checksum = retrieved_checksum;
+        stash_segment(socket, recv_ack_header, socket->recvbuf + sizeof(microtcp_header_t), tos);
+    }
+
+    //Segments with data are not duplicate ACKs, the peer just has nothing new to acknowledge
+    if(socket->last_ack_number == recv_ack_header->ack_number && recv_ack_header->window != 0 && recv_ack_header->data_len == 0){
         socket->duplicate_ack_count++;
+        result = socket->duplicate_ack_count;
         if(socket->duplicate_ack_count == 3){
             socket->duplicate_ack_count = 0;
-            return 3;   //3 duplicate acks
-        }
-        else if(socket->duplicate_ack_count == 1){
-            return 1;   //duplicate ack
+            //3 duplicate acks
         }
+        free(recv_ack_header);
+        return result;   //duplicate ack
     }else{
         socket->last_ack_number = recv_ack_header->ack_number;
+        socket->duplicate_ack_count = 0;
     }
-    socket->curr_win_size = recv_ack_header->window;
-
 
+    free(recv_ack_header);
     return 0;
 }
 
@@ -29,19 +29,124 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <poll.h>
+#include <sys/epoll.h>
 
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
 
 /*
  * Several useful constants
  */
 #define MICROTCP_ACK_TIMEOUT_US 200000
-#define MICROTCP_MSS 1400
+#define MICROTCP_MSS 1400                  /* Segment size every path is assumed to carry */
+#define MICROTCP_MIN_MSS 536
+#define MICROTCP_MAX_MSS 8940              /* 9000 byte jumbo frames, less the IP, UDP and microTCP headers */
 #define MICROTCP_RECVBUF_LEN 1073741824 
 #define MICROTCP_WIN_SIZE MICROTCP_RECVBUF_LEN
+#define MICROTCP_RCVBUF_INIT 16384         /* Receive buffer a connection starts with */
+#define MICROTCP_RCVBUF_MAX 4194304        /* Default cap of the receive buffer auto-tuning */
+#define MICROTCP_SNDBUF_DEFAULT 1048576    /* Default limit of the data microtcp_send() queues */
+#define MICROTCP_SNDLOWAT_DEFAULT 16384    /* Free space a full send buffer waits for */
+#define MICROTCP_MAX_WSCALE 14             /* Largest window scale, 2^14 * 64KB = MICROTCP_RECVBUF_LEN */
 #define MICROTCP_INIT_CWND (3 * MICROTCP_MSS)
 #define MICROTCP_INIT_SSTHRESH MICROTCP_WIN_SIZE
+#define MICROTCP_MIN_RTO_US MICROTCP_ACK_TIMEOUT_US
+#define MICROTCP_MAX_RTO_US 60000000
+#define MICROTCP_TLP_MIN_PTO_US 10000
+#define MICROTCP_MAX_PERSIST_US 60000000
+#define MICROTCP_DELACK_SEGMENTS 2
+#define MICROTCP_DELACK_TIMEOUT_US 5000
+#define MICROTCP_ACK_FREQ_MAX 255
+#define MICROTCP_OPT_ACK_FREQ_MASK 0x000000ff
+#define MICROTCP_OPT_ACK_NOW 0x00000100
+#define MICROTCP_OPT_MSS_MASK 0x0000ffff
+#define MICROTCP_OPT_WSCALE 0x01000000     /* SYN and SYN-ACK: bits 16..23 hold the window scale */
+#define MICROTCP_OPT_WSCALE_SHIFT 16
+#define MICROTCP_OPT_CONN_ID_SHIFT 16      /* After the handshake: bits 16..31 hold the connection ID */
+#define MICROTCP_CORK_TIMEOUT_US 200000
+#define MICROTCP_NAGLE_TIMEOUT_US 5000
+#define MICROTCP_PLPMTUD_MAX_PROBES 3      /* Losses of a probe size before it is given up */
+#define MICROTCP_PLPMTUD_MIN_STEP 64       /* Stop searching once the bounds are this close */
+#define MICROTCP_PLPMTUD_RAISE_US 600000000  /* Search for a larger size again after 10 minutes */
+#define MICROTCP_HYSTART_LOW_WINDOW (16 * MICROTCP_MSS)
+#define MICROTCP_HYSTART_MIN_SAMPLES 8
+#define MICROTCP_HYSTART_ACK_DELTA_US 2000
+#define MICROTCP_HYSTART_DELAY_MIN_US 4000
+#define MICROTCP_HYSTART_DELAY_MAX_US 16000
+#define MICROTCP_PACING_SS_GAIN 200        /* Percent of cwnd/SRTT to pace at in slow start */
+#define MICROTCP_PACING_CA_GAIN 120        /* and in congestion avoidance */
+#define MICROTCP_PACING_SLACK_NS 50000     /* Don't sleep for less than that, send a small burst instead */
+#define MICROTCP_ENGINE_TICK_US 1000       /* The protocol I/O thread checks its timers this often while they run */
+#define MICROTCP_LISTEN_FLOWS_INIT 64      /* Initial size of a listener's connection table */
+#define MICROTCP_SYN_RTO_US 1000000        /* First retransmission timeout of SYNs and SYN-ACKs (RFC 6298) */
+#define MICROTCP_SYN_RETRIES 6             /* SYN retransmissions before microtcp_connect() gives up */
+#define MICROTCP_SYNACK_RETRIES 5          /* SYN-ACK retransmissions before a handshake is dropped */
+#define MICROTCP_SYNCOOKIE_PCT 75          /* Percent of the backlog in handshakes past which SYNs get cookies */
+#define MICROTCP_SYNCOOKIE_TICK_S 64       /* A SYN cookie is valid for one to two ticks */
+#define MICROTCP_WHEEL_TICK_US 1000       /* Resolution of the timer wheel */
+#define MICROTCP_RUNTIME_DEQUE 256         /* Connections a runtime worker holds for others to steal, a power of 2 */
+#define MICROTCP_RUNTIME_IDLE_US 1000      /* An idle runtime worker looks for connections to steal this often */
+#define MICROTCP_URING_ENTRIES 64          /* Submission queue of the io_uring backend, the most sends it holds */
+#define MICROTCP_URING_BUFS 32             /* Datagrams the io_uring backend receives ahead, a power of 2 */
+
+/*
+ * Control bits of the header
+ */
+#define MICROTCP_CTRL_FIN 0x0001
+#define MICROTCP_CTRL_SYN 0x0002
+#define MICROTCP_CTRL_ACK 0x0008
+#define MICROTCP_CTRL_ECE 0x0010           /* ECN echo, in a SYN: the sender supports ECN */
+#define MICROTCP_CTRL_CWR 0x0020           /* Congestion window reduced */
+
+/*
+ * ECN codepoints of the IP TOS byte
+ */
+#define MICROTCP_ECN_MASK 0x03
+#define MICROTCP_ECN_ECT0 0x02
+#define MICROTCP_ECN_CE 0x03
+
+/*
+ * Socket options, see microtcp_setsockopt()
+ */
+#define MICROTCP_SO_PACING 1               /* int, one of the MICROTCP_PACING_* modes */
+#define MICROTCP_SO_PACING_RATE 2          /* uint64_t, pacing rate in bytes/s, 0 to derive it from cwnd/SRTT */
+#define MICROTCP_SO_RATE_LIMIT 3           /* microtcp_rate_limit_t, token bucket cap on the sending rate */
+#define MICROTCP_SO_ECN 4                  /* int, offer ECN in the handshake, set before connect/accept */
+#define MICROTCP_SO_ACK_FREQ 5             /* int, segments per ACK we ask of the peer, 1..255, 0 = its default */
+#define MICROTCP_SO_CORK 6                 /* int, hold partial segments until uncorked, at most MICROTCP_CORK_TIMEOUT_US */
+#define MICROTCP_SO_NAGLE 7                /* int, coalesce small writes for at most MICROTCP_NAGLE_TIMEOUT_US */
+#define MICROTCP_SO_MAXSEG 8               /* int, largest segment we accept and send, set before connect/accept */
+#define MICROTCP_SO_PLPMTUD 9              /* int, probe for segments larger than MICROTCP_MSS, on by default */
+#define MICROTCP_SO_RCVBUF 10              /* int, largest receive buffer auto-tuning may grow to, set before connect/accept */
+#define MICROTCP_SO_RCVLOWAT 11            /* int, microtcp_recv() waits for at least this many bytes, 1 by default */
+#define MICROTCP_SO_SNDBUF 12              /* int, most data queued for sending, acknowledged or not */
+#define MICROTCP_SO_SNDLOWAT 13            /* int, free space microtcp_send() waits for once the send buffer is full */
+#define MICROTCP_SO_ENGINE 14              /* int, run the connection on a protocol I/O thread, set once connected */
+#define MICROTCP_SO_SYNCOOKIES 15          /* int, one of the MICROTCP_SYNCOOKIES_* modes, set before microtcp_listen() */
+#define MICROTCP_SO_NONBLOCK 16            /* int, fail with EAGAIN instead of waiting, see microtcp_poll() */
+#define MICROTCP_SO_BUSY_POLL 17           /* int, microseconds a read spins before it sleeps, 0 (the default) never spins */
+#define MICROTCP_SO_HYSTART 18            /* int, leave slow start once the path looks full, on by default */
+
+#define MICROTCP_SOCK_URING 0x40000000     /* OR'ed into the type of microtcp_socket(), send and receive through io_uring */
+
+#define MICROTCP_PACING_OFF 0
+#define MICROTCP_PACING_TIMER 1            /* Sleep on a high resolution timer between segments */
+#define MICROTCP_PACING_TXTIME 2           /* Hand departure times to the kernel with SO_TXTIME, needs the fq qdisc */
+
+/*
+ * SYN cookie modes of a listener
+ */
+#define MICROTCP_SYNCOOKIES_OFF 0          /* SYNs that find the backlog full are dropped */
+#define MICROTCP_SYNCOOKIES_AUTO 1         /* Past MICROTCP_SYNCOOKIE_PCT of the backlog (the default) */
+#define MICROTCP_SYNCOOKIES_ALWAYS 2
+
+/*
+ * What a microtcp_handler_t returns
+ */
+#define MICROTCP_TASK_DONE 0               /* The runtime shuts the connection down */
+#define MICROTCP_TASK_YIELD 1              /* Call the handler again, maybe on another worker */
 
 
 /**
@@ -63,6 +168,70 @@ typedef enum
 } mircotcp_state_t;
 
 
+/**
+ * Book-keeping of a single segment of a microtcp_send() call, used by the
+ * sender to detect losses and retransmit.
+ */
+typedef struct
+{
+    uint32_t seq_number;          /**< Sequence number of the first byte */
+    size_t offset;                /**< Offset of the data in the user's buffer */
+    size_t length;                /**< Data length in bytes */
+    uint32_t xmit_ts;             /**< Timestamp of the last (re)transmission, 0 if never sent */
+    uint8_t retransmitted;        /**< Set if the segment has been sent more than once */
+    uint8_t probe;                /**< Set if the segment is a PLPMTUD probe */
+} microtcp_segment_t;
+
+/**
+ * Data queued by microtcp_send() waits here, sent or not, until it is
+ * acknowledged, along with the sender's state between calls.
+ */
+typedef struct
+{
+    uint8_t *buf;                 /**< Queued data, from the oldest unacknowledged byte on */
+    size_t buf_size;              /**< Allocated size of buf */
+    size_t len;                   /**< Bytes in buf */
+    uint32_t start_seq;           /**< Sequence number of buf[0] */
+    microtcp_segment_t *segments; /**< Segments cut from buf so far */
+    size_t nsegs;                 /**< Room in segments */
+    size_t built;                 /**< Segments cut */
+    size_t built_len;             /**< Bytes they cover */
+    size_t una;                   /**< First unacknowledged segment */
+    size_t next;                  /**< Next segment to send */
+    uint32_t recovery_seq;        /**< Fast recovery ends once this is acknowledged */
+    uint32_t rto_start;           /**< The RTO runs from here */
+    uint32_t persist_us;          /**< Persist timer, 0 while the peer's window is open */
+    uint32_t persist_deadline;
+    uint32_t reo_deadline;        /**< RACK reordering timer */
+    uint8_t in_recovery;
+    uint8_t tlp_sent;
+    uint8_t reo_armed;
+} microtcp_sndq_t;
+
+/* Protocol I/O thread of a connection, see MICROTCP_SO_ENGINE */
+struct microtcp_engine;
+struct microtcp_uring;
+
+/* Demultiplexer of a socket that accepts many connections, see microtcp_listen() */
+struct microtcp_listener;
+
+/* Sharded server, see microtcp_runtime_start() */
+struct microtcp_runtime;
+
+/**
+ * Identifies a connection of a listener: its 4-tuple, addresses and ports
+ * in network byte order, and the connection ID the client's segments carry.
+ */
+typedef struct
+{
+    uint32_t peer_addr;
+    uint32_t local_addr;
+    uint16_t peer_port;
+    uint16_t local_port;
+    uint16_t conn_id;
+} microtcp_flow_key_t;
+
+
 /**
  * This is the microTCP socket structure. It holds all the necessary
  * information of each microTCP socket.
@@ -72,11 +241,12 @@ typedef enum
 typedef struct
 {
     int sd;                       /**< The underline UDP socket descriptor */
+    int rx_sd;                    /**< Datagrams are read from here, sd unless a listener demultiplexes them */
     struct sockaddr *server_ip;     /**< Sockaddr for the server's ip(ADDED) */
     struct sockaddr_in *client_ip;  /**< Sockaddr_in for the client's ip(ADDED) */
 
     mircotcp_state_t state;         /**< The state of the microTCP socket */
-    size_t init_win_size;         /**< The window size negotiated at the 3-way handshake */
+    size_t init_win_size;         /**< Size of our receive buffer, grown by auto-tuning */
     size_t curr_win_size;         /**< The current window size */
 
     uint8_t *sendbuf;             /**< The *send* buffer of the TCP connection used to send messages
@@ -87,6 +257,13 @@ typedef struct
                                         is freed at the shutdown of the connection. This buffer is used
                                         to retrieve the data from the network. */
     size_t buf_fill_level;        /**< Amount of data in the buffer */
+    size_t rcv_wnd_adv;           /**< The window we advertised last */
+    size_t rcvbuf_max;            /**< Auto-tuning grows the receive buffer up to this */
+    uint8_t rcv_wscale;           /**< Our window goes out shifted right by this */
+    uint8_t snd_wscale;           /**< The peer's window is shifted left by this */
+    uint32_t rcv_rtt_us;          /**< Receiver's RTT estimate, 0 until the peer echoed one of our timestamps */
+    size_t rcv_copied;            /**< Data the application read in the current RTT */
+    uint32_t rcv_space_ts;        /**< Start of the current RTT */
 
     size_t cwnd;
     size_t ssthresh;
@@ -97,6 +274,95 @@ typedef struct
     size_t last_ack_number;       /**< Keep the state of the last ack number */
     size_t duplicate_ack_count;   /**< Keep the state of the duplicate ack count */
 
+    uint32_t srtt_us;             /**< Smoothed RTT in microseconds, 0 until the first sample */
+    uint32_t rttvar_us;           /**< RTT variation in microseconds */
+    uint32_t min_rtt_us;          /**< Minimum RTT observed on the connection */
+    uint32_t rto_us;              /**< Current retransmission timeout */
+    uint32_t ts_recent;           /**< Last timestamp received from the peer, echoed in our segments */
+    uint32_t ts_echo;             /**< Timestamp the peer echoed back in its last ACK */
+    uint32_t last_xmit_ts;        /**< Timestamp of the last segment we transmitted */
+    uint32_t rack_xmit_ts;        /**< RACK: send time of the most recently delivered segment */
+    uint32_t rack_rtt_us;         /**< RACK: RTT measured on that segment */
+    size_t prior_cwnd;            /**< cwnd before the current loss episode, restored on spurious retransmissions */
+    size_t prior_ssthresh;        /**< ssthresh before the current loss episode */
+    uint32_t undo_ts;             /**< Time of the first retransmission of the loss episode, 0 if none */
+
+    uint8_t hystart_enabled;      /**< Leave slow start early with HyStart, see MICROTCP_SO_HYSTART */
+    uint32_t hystart_round_end;   /**< HyStart: the round ends when this sequence number is ACKed */
+    uint32_t hystart_round_start; /**< HyStart: start time of the current round */
+    uint32_t hystart_last_ack;    /**< HyStart: time of the last ACK of the current ACK train */
+    uint32_t hystart_curr_rtt_us; /**< HyStart: minimum RTT of the current round */
+    uint32_t hystart_last_rtt_us; /**< HyStart: minimum RTT of the previous round */
+    uint32_t hystart_samples;     /**< HyStart: RTT samples taken in the current round */
+
+    int pacing;                   /**< Pacing mode, one of MICROTCP_PACING_* */
+    uint64_t pacing_rate;         /**< Pacing rate in bytes/s supplied by the application or the
+                                    congestion control, 0 to pace at cwnd/SRTT */
+    uint64_t pacing_next_ns;      /**< Earliest departure time of the next data segment */
+
+    uint64_t tb_rate;             /**< Token bucket rate in bytes/s, 0 if the sending rate is not limited */
+    uint64_t tb_burst;            /**< Token bucket depth in bytes */
+    int64_t tb_tokens;            /**< Bytes that may be sent right now, negative after forced sends */
+    uint64_t tb_last_ns;          /**< Last time the bucket was refilled */
+
+    uint8_t ecn;                  /**< ECN is offered in the handshake */
+    uint8_t ecn_ok;               /**< ECN was negotiated, our datagrams are sent ECT(0) */
+    uint8_t ecn_ce_pending;       /**< Receiver: echo ECE in our ACKs until the peer sends CWR */
+    uint8_t ecn_echo;             /**< Sender: the last ACK carried ECE */
+    uint8_t ecn_cwr_pending;      /**< Sender: set CWR on the next data segment */
+    uint32_t ecn_cwr_seq;         /**< Sender: don't reduce cwnd again until this is ACKed */
+
+    uint8_t ack_freq;             /**< Sender: segments per ACK asked of the peer, 0 = its default */
+    uint8_t ack_now_pending;      /**< Sender: ask for an immediate ACK on the next data segment */
+    uint8_t peer_ack_freq;        /**< Receiver: segments per ACK the peer asked for, 0 = default */
+    uint32_t delack_pending;      /**< Receiver: in-order segments not acknowledged yet */
+    uint32_t delack_ts;           /**< Receiver: arrival of the first of them */
+    uint32_t rcvtimeo_us;         /**< How long a read of rx_sd may block, 0 = until data arrives */
+    uint8_t rx_queued;            /**< The last read got a datagram, try the next one before waiting */
+    uint8_t pingpong;             /**< We answer what we receive, delay ACKs to carry them on the answer */
+    uint32_t last_data_rcv_ts;    /**< Arrival of the last in-order data segment */
+    uint8_t *stash;               /**< A segment for microtcp_recv() that our_receive() read while waiting for an ACK */
+    size_t stash_len;             /**< Its length with the header, 0 = empty */
+    uint8_t stash_tos;            /**< Its TOS byte */
+
+    uint32_t mss;                 /**< Segment size we send with */
+    uint32_t local_mss;           /**< Largest segment we accept, sent in our SYN */
+    uint32_t peer_mss;            /**< Largest segment the peer accepts */
+    uint32_t rcv_mss;             /**< Largest segment received from the peer */
+    uint8_t *rcv_leftover;        /**< Received data that did not fit in the user's buffer */
+    size_t rcv_leftover_off;
+    size_t rcv_leftover_len;
+    size_t rcvlowat;              /**< MICROTCP_SO_RCVLOWAT */
+
+    uint8_t plpmtud;              /**< Packetization layer path MTU discovery (RFC 8899) */
+    uint32_t plpmtud_high;        /**< Smallest segment size known not to get through, less one */
+    uint32_t plpmtud_probe;       /**< Segment size being probed, 0 if none chosen yet */
+    uint8_t plpmtud_inflight;     /**< A probe of that size is in flight */
+    uint8_t plpmtud_fails;        /**< Times a probe of that size got lost */
+    uint8_t plpmtud_rtos;         /**< Back to back RTOs, a black hole at the current size */
+    uint32_t plpmtud_raise_ts;    /**< When the search for a larger size ended */
+    uint32_t xmit_pad;            /**< Pad the next data segment to this many bytes, for probes */
+
+    microtcp_sndq_t snd;          /**< Send buffer and the sender's state */
+    size_t sndbuf_max;            /**< MICROTCP_SO_SNDBUF */
+    size_t sndlowat;              /**< MICROTCP_SO_SNDLOWAT */
+
+    uint8_t cork;                 /**< MICROTCP_SO_CORK is set */
+    uint8_t nagle;                /**< MICROTCP_SO_NAGLE is set */
+    uint8_t *cork_buf;            /**< Small writes waiting to fill a segment */
+    size_t cork_len;              /**< Bytes in cork_buf */
+    uint32_t cork_ts;             /**< When the first of them was written */
+
+    struct microtcp_engine *engine; /**< Protocol I/O thread, NULL unless MICROTCP_SO_ENGINE is set */
+    struct microtcp_listener *listener; /**< Of a listening socket, or of the one a connection came from */
+    uint8_t syncookies;           /**< MICROTCP_SO_SYNCOOKIES */
+    uint8_t nonblock;             /**< MICROTCP_SO_NONBLOCK */
+    uint32_t busy_poll_us;        /**< MICROTCP_SO_BUSY_POLL */
+    int poll_error;               /**< Why sending or acknowledging failed while polling, reported as POLLERR */
+    struct microtcp_uring *uring; /**< io_uring the datagrams go through, NULL for plain system calls */
+    uint16_t conn_id;             /**< Connection ID, derived from the client's initial sequence number */
+    microtcp_flow_key_t flow;     /**< Key of the connection in its listener's table */
+
 
     uint64_t packets_send;
     uint64_t packets_received;
@@ -104,6 +370,15 @@ typedef struct
     uint64_t bytes_send;
     uint64_t bytes_received;
     uint64_t bytes_lost;
+    uint64_t spurious_retransmits;
+    uint64_t ecn_ce_received;
+    uint64_t acks_delayed;
+    uint64_t window_probes;
+    uint64_t plpmtud_probes;
+    uint64_t busy_poll_ns;
+    uint64_t busy_poll_wasted_ns;
+    uint64_t busy_poll_hits;
+    uint64_t busy_poll_misses;
 } microtcp_sock_t;
 
 
@@ -124,26 +399,123 @@ typedef struct
     uint32_t checksum;            /**< CRC-32 checksum, see crc32() in utils folder */
 } microtcp_header_t;
 
+/**
+ * Value of the MICROTCP_SO_RATE_LIMIT socket option. Every datagram carrying
+ * data, header included, takes tokens from a bucket that fills at rate bytes
+ * per second up to burst bytes.
+ */
+typedef struct
+{
+    uint64_t rate;                /**< Sustained sending rate in bytes/s, 0 removes the limit */
+    uint64_t burst;               /**< Largest burst in bytes, at least one full segment */
+} microtcp_rate_limit_t;
+
+/*
+ * The future_use fields of the header carry timestamps on every segment:
+ * future_use1 holds the sender's timestamp (TSval) and future_use2 echoes
+ * the last timestamp received from the peer (TSecr). Timestamps are
+ * microseconds of a monotonic clock, truncated to 32 bits.
+ *
+ * The low byte of future_use0 on data segments is the ACK frequency the
+ * sender asks for: the receiver acknowledges every that many in-order
+ * segments, or MICROTCP_DELACK_SEGMENTS when it is 0. MICROTCP_OPT_ACK_NOW
+ * asks for an immediate ACK, the sender sets it on the last segment it can
+ * send before it has to wait for one.
+ *
+ * In the SYN and SYN-ACK the low 16 bits of future_use0 are the largest
+ * segment the sender of the SYN accepts (MSS option), 0 meaning MICROTCP_MSS.
+ * With MICROTCP_OPT_WSCALE set, bits 16..23 are the shift its window is
+ * advertised with (window scale option, RFC 7323). Scaling is used only if
+ * both ends send it, and the windows of the SYN and SYN-ACK are never scaled.
+ */
+
+
+
 
 
 
 
 ssize_t min_for3(size_t a, size_t b, size_t c);
 
+uint32_t microtcp_ts_now(void);
+
 ssize_t our_send(microtcp_sock_t *socket, const void *buffer, size_t length, int flags);
 
-ssize_t our_receive(microtcp_sock_t* socket, int flags);
+/**
+ * Same as our_send() but sends the segment with the given sequence number,
+ * without advancing socket->seq_number. Used for retransmissions.
+ */
+ssize_t our_send_seq(microtcp_sock_t *socket, uint32_t seq_number, const void *buffer, size_t length, int flags);
 
+/**
+ * Waits up to timeout_us for an ACK and updates the RTT and RACK state.
+ *
+ * @return 0 on a new ACK, the duplicate ACK count (1 or 2) on a duplicate ACK,
+ * 3 on the third duplicate ACK, -2 on timeout and -1 on error.
+ */
+ssize_t our_receive(microtcp_sock_t* socket, int flags, uint32_t timeout_us);
 
 
 
+
+/**
+ * Creates a microTCP socket on top of a UDP socket.
+ *
+ * With MICROTCP_SOCK_URING in type the connection's datagrams go through an
+ * io_uring of its own: a multishot recvmsg keeps filling buffers the kernel
+ * takes from a provided buffer ring, and the segments a burst sends are
+ * submitted together, with one system call. Only sockets that read their
+ * own UDP socket use it: a listening socket's connections are fed by its
+ * thread and use plain system calls. Where the kernel can't do that (it
+ * takes Linux 6.0) the socket falls back to plain system calls.
+ *
+ * @param domain the domain of the UDP socket
+ * @param type SOCK_DGRAM, optionally OR'ed with MICROTCP_SOCK_URING
+ * @param protocol the protocol of the UDP socket
+ * @return the socket structure
+ */
 microtcp_sock_t
 microtcp_socket (int domain, int type, int protocol);
 
+/**
+ * Sets a microTCP socket option.
+ *
+ * MICROTCP_SO_ENGINE hands the connection to a thread of its own, which
+ * sends, acknowledges and retransmits no matter what the application is
+ * doing. microtcp_send() and microtcp_recv() then only exchange data with it
+ * through lock-free rings, the socket structure must stay where it is, and
+ * no other option can be changed until the engine is turned off again.
+ *
+ * MICROTCP_SO_BUSY_POLL makes a read that finds nothing spin on
+ * non-blocking reads before it sleeps, a wakeup takes tens of microseconds.
+ * The UDP socket gets SO_BUSY_POLL as well where the kernel allows it, so
+ * that each of those reads polls the device queue. busy_poll_ns counts the
+ * time spent spinning and busy_poll_hits the spins that got a datagram,
+ * busy_poll_misses those that ran out and busy_poll_wasted_ns their time.
+ *
+ * @param socket the socket structure
+ * @param optname one of the MICROTCP_SO_* options
+ * @param optval pointer to the option value, its type depends on the option
+ * @param optlen the size of the option value
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_setsockopt (microtcp_sock_t *socket, int optname, const void *optval,
+                     socklen_t optlen);
+
 int
 microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address,
                socklen_t address_len);
 
+/**
+ * Connects to a remote peer. The SYN is retransmitted with exponential
+ * backoff, MICROTCP_SYN_RETRIES times at most, until a SYN-ACK comes back.
+ *
+ * @param socket the socket structure
+ * @param address the address of the peer
+ * @param address_len the length of the address structure
+ * @return 1 on success, -1 with errno ETIMEDOUT if the peer never answered
+ */
 int
 microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
                   socklen_t address_len);
@@ -161,14 +533,218 @@ int
 microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
                  socklen_t address_len);
 
+/**
+ * Makes a bound socket accept many concurrent connections on its port. A
+ * thread reads every datagram that arrives and hands it to its connection,
+ * found by 4-tuple and connection ID. It also runs the handshakes of new
+ * connections, concurrently, retransmitting SYN-ACKs with exponential
+ * backoff, and queues the connections whose handshake completed for
+ * microtcp_accept_conn(). SYNs that find backlog handshakes in progress
+ * already are dropped, the client retransmits them.
+ *
+ * Unless MICROTCP_SO_SYNCOOKIES says otherwise, once the handshakes in
+ * progress take MICROTCP_SYNCOOKIE_PCT of the backlog new SYNs are answered
+ * with SYN cookies: the SYN-ACK's sequence number encodes what the SYN
+ * negotiated, and nothing is kept or allocated for the connection until the
+ * client's ACK brings it back.
+ *
+ * @param socket a bound socket, it stays in the LISTEN state
+ * @param backlog the most handshakes in progress, and the most completed
+ * connections waiting for microtcp_accept_conn()
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_listen (microtcp_sock_t *socket, int backlog);
+
+/**
+ * Takes the connection that completed its handshake first on a listening
+ * socket, blocking until there is one. The connection inherits the options
+ * the listening socket had when microtcp_listen() was called and is used
+ * and shut down as any other, but its listener must be shut down last.
+ *
+ * @param socket the listening socket
+ * @param conn filled in with the new connection
+ * @param address stores the peer's address, it must outlive the connection
+ * @param address_len the length of the address structure
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_accept_conn (microtcp_sock_t *socket, microtcp_sock_t *conn,
+                      struct sockaddr *address, socklen_t address_len);
+
+/**
+ * Serves a connection of a microtcp_runtime_start() server. It returns
+ * MICROTCP_TASK_DONE when it is done with the connection, which the runtime
+ * then shuts down, or MICROTCP_TASK_YIELD to be called again later, for
+ * instance after each request of a long lived connection, so that the worker
+ * gets to the others in the meantime and an idle one may take it over. conn
+ * stays at the same address until it is shut down, state of the handler's
+ * own can be looked up by it.
+ */
+typedef int (*microtcp_handler_t) (microtcp_sock_t *conn, void *arg);
+
+/**
+ * Starts a server of nworkers worker threads on the port of address. Each
+ * worker has a listening socket of its own on the port, SO_REUSEPORT lets
+ * the kernel spread the clients over them, and it is pinned to a CPU along
+ * with its listener's thread. A worker hands the connections of its listener
+ * to handler, one at a time. Connections that yield wait on the worker's
+ * deque, and a worker that runs out of connections steals from the others,
+ * their deques first and then what their listeners accepted, so a few busy
+ * clients don't hold up those that arrived at the same worker. Start more
+ * workers than CPUs to serve more connections at once.
+ *
+ * @param address the address to listen on
+ * @param address_len the length of the address structure
+ * @param nworkers the number of workers, 0 or less for one per CPU we may run on
+ * @param backlog the backlog of each listening socket, see microtcp_listen()
+ * @param tmpl a socket whose options the listening sockets take, or NULL
+ * @param handler called by the workers with every new connection
+ * @param arg passed to handler
+ * @return the runtime, or NULL on failure
+ */
+struct microtcp_runtime *
+microtcp_runtime_start (const struct sockaddr *address, socklen_t address_len,
+                        int nworkers, int backlog, const microtcp_sock_t *tmpl,
+                        microtcp_handler_t handler, void *arg);
+
+/**
+ * Stops a runtime once the handlers that are running return, and closes
+ * its listening sockets.
+ *
+ * @param rt the runtime
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_runtime_stop (struct microtcp_runtime *rt);
+
 int
 microtcp_shutdown(microtcp_sock_t *socket, int how);
 
+/**
+ * Queues data for sending and returns once it is copied into the send
+ * buffer. Only when MICROTCP_SO_SNDBUF bytes are waiting to be acknowledged
+ * does it wait, until MICROTCP_SO_SNDLOWAT bytes are free again. Queued data
+ * is sent and retransmitted as the windows allow on every call to the
+ * library, and all of it is acknowledged before microtcp_recv() and
+ * microtcp_shutdown() go on.
+ *
+ * With MICROTCP_SO_CORK, MICROTCP_SO_NAGLE or MSG_MORE in flags, a tail
+ * shorter than a segment is kept back and sent together with the next
+ * write. It goes out once a segment fills up, when the socket is uncorked,
+ * before microtcp_recv() and microtcp_shutdown(), or on the next call after
+ * its timer ran out.
+ *
+ * @return the number of bytes queued or kept back, or -1 on failure
+ */
 ssize_t
 microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
                int flags);
 
+/**
+ * Receives data from the peer as a byte stream. Waits until at least
+ * MICROTCP_SO_RCVLOWAT bytes arrived, or the whole buffer with MSG_WAITALL
+ * in flags, then keeps filling the buffer for as long as segments can be
+ * read without blocking.
+ *
+ * @return the number of bytes received, or -1 once the peer closed the
+ * connection or on failure
+ */
 ssize_t
 microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags);
 
+/*
+ * Non-blocking sockets. With MICROTCP_SO_NONBLOCK set, or MSG_DONTWAIT in
+ * the flags of a call, microtcp_send() queues what fits in the send buffer
+ * and fails with EAGAIN if nothing does, microtcp_recv() returns what
+ * arrived already and fails with EAGAIN if nothing did, or with ENOTCONN
+ * once the peer closed the connection, and microtcp_accept_conn() fails
+ * with EAGAIN while no handshake completed. Held back writes are sent but
+ * not waited for. microtcp_connect(), microtcp_accept() and
+ * microtcp_shutdown() block all the same. A listener's connections inherit
+ * the option. Sockets run by MICROTCP_SO_ENGINE can't be polled.
+ *
+ * Readiness comes from the protocol's state, not from the UDP socket: a
+ * connection is readable once in-order data or the peer's FIN waits for
+ * microtcp_recv(), writable while MICROTCP_SO_SNDLOWAT bytes of the send
+ * buffer are free, and a listening socket is readable while a connection
+ * waits to be accepted. ACKs, window updates and retransmissions are taken
+ * care of while polling. A polled socket must stay at the same address.
+ */
+typedef struct
+{
+    microtcp_sock_t *socket;      /**< NULL to leave the entry out */
+    short events;                 /**< POLLIN and POLLOUT */
+    short revents;                /**< Those that are ready, POLLERR, POLLHUP and POLLNVAL as well */
+} microtcp_pollfd_t;
+
+typedef struct
+{
+    uint32_t events;              /**< EPOLLIN, EPOLLOUT, EPOLLERR and EPOLLHUP */
+    void *data;                   /**< As given to microtcp_epoll_ctl() */
+} microtcp_epoll_event_t;
+
+struct microtcp_epoll;
+
+/**
+ * Waits for one of the sockets to be ready, like poll(2).
+ *
+ * @param fds the sockets and the events to wait for
+ * @param nfds the number of entries in fds
+ * @param timeout in milliseconds, -1 to wait for as long as it takes
+ * @return the number of entries with revents set, 0 on timeout, -1 on failure
+ */
+int
+microtcp_poll (microtcp_pollfd_t *fds, nfds_t nfds, int timeout);
+
+/**
+ * Creates a set of sockets to wait on, like epoll_create(2). Readiness is
+ * level triggered: a socket is reported by every microtcp_epoll_wait() for
+ * as long as it is ready.
+ *
+ * @return the set, or NULL on failure
+ */
+struct microtcp_epoll *
+microtcp_epoll_create (void);
+
+/**
+ * Adds a socket to the set, changes what it waits for or removes it.
+ *
+ * @param ep the set
+ * @param op EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+ * @param socket the socket, it must stay at the same address while in the set
+ * @param events EPOLLIN and EPOLLOUT
+ * @param data reported along with the socket's events
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_epoll_ctl (struct microtcp_epoll *ep, int op, microtcp_sock_t *socket,
+                    uint32_t events, void *data);
+
+/**
+ * Waits for sockets of the set to be ready, like epoll_wait(2).
+ *
+ * @param ep the set
+ * @param events filled in with the sockets that are ready
+ * @param maxevents the number of entries in events
+ * @param timeout in milliseconds, -1 to wait for as long as it takes
+ * @return the number of entries filled in, 0 on timeout, -1 on failure
+ */
+int
+microtcp_epoll_wait (struct microtcp_epoll *ep, microtcp_epoll_event_t *events,
+                     int maxevents, int timeout);
+
+/**
+ * A file descriptor that is readable while microtcp_epoll_wait() has
+ * something to do, to wait for the set in an event loop of the
+ * application's. It is readable again after a microtcp_epoll_wait() that
+ * left sockets ready.
+ */
+int
+microtcp_epoll_fd (struct microtcp_epoll *ep);
+
+/* Frees the set, the sockets in it stay as they are */
+void
+microtcp_epoll_close (struct microtcp_epoll *ep);
+
 #endif /* LIB_MICROTCP_H_ */
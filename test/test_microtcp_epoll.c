@@ -0,0 +1,164 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests non-blocking sockets on the loopback: one thread serves two clients
+ * at once from an event loop, which waits on microtcp_epoll_fd() with
+ * poll(2) and takes the events with microtcp_epoll_wait(). The listening
+ * socket and both connections are in the set, requests are echoed and the
+ * clients close the connections.
+ */
+
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+#include<poll.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<unistd.h>
+#include<string.h>
+#include<errno.h>
+#include<time.h>
+#include<pthread.h>
+#include "../lib/microtcp.h"
+
+#define CLIENTS 2
+#define REQUESTS 16
+#define DEADLINE_S 20
+
+static struct sockaddr_in server_addr;
+
+/* Blocking client, it closes the connection once its requests were echoed */
+static void *client_main(void *arg){
+    microtcp_sock_t client = microtcp_socket(AF_INET, SOCK_DGRAM, 0);
+    char request[32], buffer[32];
+    int i = 0, ok = 1;
+
+    if(client.sd == -1 || microtcp_connect(&client, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1){
+        printf("(!) Could not connect!\n");
+        return NULL;
+    }
+    for(i = 0; i < REQUESTS && ok; i++){
+        snprintf(request, sizeof(request), "client %d request %d", (int)(intptr_t)arg, i);
+        memset(buffer, 0, sizeof(buffer));
+        ok = microtcp_send(&client, request, strlen(request), 0) == (ssize_t)strlen(request)
+             && microtcp_recv(&client, buffer, strlen(request), MSG_WAITALL) == (ssize_t)strlen(request)
+             && strcmp(buffer, request) == 0;
+    }
+    if(!ok) printf("(!) Request not echoed!\n");
+    microtcp_shutdown(&client, SHUT_RDWR);
+    return ok ? arg : NULL;
+}
+
+int main(int argc, char **argv){
+    microtcp_sock_t listener, conns[CLIENTS];
+    struct sockaddr_in peers[CLIENTS];
+    microtcp_epoll_event_t events[CLIENTS + 1];
+    struct microtcp_epoll *ep = NULL;
+    struct pollfd pfd;
+    pthread_t clients[CLIENTS];
+    time_t deadline = time(NULL) + DEADLINE_S;
+    void *result = NULL;
+    char buffer[64];
+    int on = 1, accepted = 0, closed = 0, failed = 0, ready = 0, i = 0;
+    ssize_t len = 0;
+
+    if(argc < 2){
+        printf("Execute the command with \"test_microtcp_epoll [port_number]\"\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[1]));
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    listener = microtcp_socket(AF_INET, SOCK_DGRAM, 0);
+    if(listener.sd == -1 || microtcp_bind(&listener, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 ||
+       microtcp_setsockopt(&listener, MICROTCP_SO_NONBLOCK, &on, sizeof(on)) == -1 ||
+       microtcp_listen(&listener, CLIENTS) == -1){
+        printf("(!) Could not listen!\n");
+        exit(EXIT_FAILURE);
+    }
+    ep = microtcp_epoll_create();
+    if(ep == NULL || microtcp_epoll_ctl(ep, EPOLL_CTL_ADD, &listener, EPOLLIN, NULL) == -1){
+        printf("(!) Could not set up the event loop!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(i = 0; i < CLIENTS; i++){
+        if(pthread_create(&clients[i], NULL, client_main, (void *)(intptr_t)(i + 1)) != 0){
+            printf("(!) Could not start the clients!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pfd.fd = microtcp_epoll_fd(ep);
+    pfd.events = POLLIN;
+    while(closed < CLIENTS && time(NULL) < deadline){
+        if(poll(&pfd, 1, 1000) == -1 && errno != EINTR){
+            perror("(!) Could not wait");
+            break;
+        }
+        ready = microtcp_epoll_wait(ep, events, CLIENTS + 1, 0);
+        for(i = 0; i < ready; i++){
+            microtcp_sock_t *socket = events[i].data;
+
+            //The listening socket is in the set with no data
+            if(socket == NULL){
+                if(accepted == CLIENTS) continue;
+                if(microtcp_accept_conn(&listener, &conns[accepted], (struct sockaddr *)&peers[accepted], sizeof(peers[accepted])) == -1){
+                    if(errno != EAGAIN) failed = 1;
+                    continue;
+                }
+                if(microtcp_epoll_ctl(ep, EPOLL_CTL_ADD, &conns[accepted], EPOLLIN, &conns[accepted]) == -1) failed = 1;
+                accepted++;
+                continue;
+            }
+            len = microtcp_recv(socket, buffer, sizeof(buffer), 0);
+            if(len == -1 && errno == EAGAIN) continue;
+            if(len == -1){
+                //ENOTCONN, the client is done
+                if(errno != ENOTCONN) failed = 1;
+                microtcp_epoll_ctl(ep, EPOLL_CTL_DEL, socket, 0, NULL);
+                microtcp_shutdown(socket, SHUT_RDWR);
+                closed++;
+                continue;
+            }
+            if(microtcp_send(socket, buffer, len, 0) != len) failed = 1;
+        }
+    }
+
+    for(i = 0; i < CLIENTS; i++){
+        pthread_join(clients[i], &result);
+        if(result == NULL) failed = 1;
+    }
+    microtcp_epoll_close(ep);
+    microtcp_shutdown(&listener, SHUT_RDWR);
+
+    if(failed || closed != CLIENTS){
+        printf("(!) Event loop did not serve the clients!\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Event loop served %d clients\n", CLIENTS);
+    return 0;
+}
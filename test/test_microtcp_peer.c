@@ -0,0 +1,245 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests a listening socket against a peer built by hand on a plain UDP
+ * socket, which sends the segments a microTCP client would not: it leaves
+ * the SYN-ACK unanswered until the listener's timer wheel sent it again,
+ * then sends segments longer than the MSS. Those too long for the receive
+ * buffer, or shorter than their header says, have to be dropped, one that
+ * fits has to be taken in whole.
+ *
+ * Then it fills the backlog with a handshake it leaves open, so that the
+ * next SYN gets a SYN cookie. ACKs of a forged and of a stale cookie have to
+ * be dropped, the right one has to complete the handshake with the MSS the
+ * cookie encoded.
+ */
+
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<sys/time.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<unistd.h>
+#include<string.h>
+#include<time.h>
+#include<errno.h>
+#include "../lib/microtcp.h"
+#include "../utils/crc32.h"
+
+#define PEER_ISN 1000
+#define PEER_CONN_ID (PEER_ISN % UINT16_MAX + 1)   /* The listener derives it from our ISN */
+#define LONG_SEGMENT (2 * MICROTCP_MSS)              /* Longer than the MSS, still within MICROTCP_MAX_MSS */
+#define HS_ISN 2000                                  /* Its handshake takes the only slot of the backlog */
+#define COOKIE_ISN 3000
+#define COOKIE_CONN_ID (COOKIE_ISN % UINT16_MAX + 1)
+#define COOKIE_MSS 1300                              /* A cookie has room for a few MSS values, 1200 is the one below */
+#define COOKIE_MSS_ENCODED 1200
+#define COOKIE_TICK (1U << 27)                       /* The counter in bits 31..27 of a cookie */
+#define COOKIE_HASH_TOP (1U << 26)                   /* Flipping it breaks the hash whatever the options */
+
+static int peer;
+
+static uint64_t now_us(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Sends a segment of data_len bytes that carries len bytes of data */
+static void peer_send(uint16_t control, uint32_t seq, uint32_t ack, uint32_t opts, const void *data, uint32_t data_len, size_t len){
+    uint8_t *packet = calloc(1, sizeof(microtcp_header_t) + len);
+    microtcp_header_t header;
+
+    if(packet == NULL){
+        printf("(!) Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(&header, 0, sizeof(header));
+    header.seq_number = seq;
+    header.ack_number = ack;
+    header.control = control;
+    header.window = UINT16_MAX;
+    header.data_len = data_len;
+    header.future_use0 = opts;
+    memcpy(packet, &header, sizeof(header));
+    if(len != 0) memcpy(packet + sizeof(header), data, len);
+    header.checksum = crc32(packet, sizeof(header) + min(len, data_len));
+    memcpy(packet, &header, sizeof(header));
+    if(send(peer, packet, sizeof(microtcp_header_t) + len, 0) == -1){
+        perror("(!) Peer could not send");
+        exit(EXIT_FAILURE);
+    }
+    free(packet);
+}
+
+/* Waits for a segment with all of control set, 0 if none came in time */
+static int peer_recv(uint16_t control, microtcp_header_t *header){
+    uint8_t buf[sizeof(microtcp_header_t) + MICROTCP_MAX_MSS];
+
+    while(recv(peer, buf, sizeof(buf), 0) >= (ssize_t)sizeof(microtcp_header_t)){
+        memcpy(header, buf, sizeof(microtcp_header_t));
+        if((header->control & control) == control) return 1;
+    }
+    return 0;
+}
+
+/* Waits for the SYN-ACK to the SYN of isn, skipping those of other handshakes */
+static int peer_synack(uint32_t isn, microtcp_header_t *header){
+    while(peer_recv(MICROTCP_CTRL_SYN | MICROTCP_CTRL_ACK, header)){
+        if(header->ack_number == isn + 1) return 1;
+    }
+    return 0;
+}
+
+/* Receives up to size bytes of conn, as long as they keep coming */
+static size_t conn_recv(microtcp_sock_t *conn, uint8_t *buffer, size_t size){
+    microtcp_pollfd_t pfd;
+    size_t received = 0;
+    ssize_t len = 0;
+
+    pfd.socket = conn;
+    pfd.events = POLLIN;
+    while(received < size && microtcp_poll(&pfd, 1, 5000) == 1){
+        len = microtcp_recv(conn, buffer + received, size - received, MSG_DONTWAIT);
+        if(len == -1 && errno == EAGAIN) continue;
+        if(len == -1) break;
+        received += len;
+    }
+    return received;
+}
+
+int main(int argc, char **argv){
+    microtcp_sock_t listener, conn, cookie_conn;
+    struct sockaddr_in server_addr, peer_addr;
+    struct timeval timeout = { 5, 0 };
+    microtcp_header_t synack, again, cookie;
+    uint64_t sent = 0, resent = 0;
+    static uint8_t data[MICROTCP_MAX_MSS + 100], buffer[LONG_SEGMENT + 4];
+    size_t received = 0, i = 0;
+    int on = 1;
+
+    if(argc < 2){
+        printf("Execute the command with \"test_microtcp_peer [port_number]\"\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[1]));
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listener = microtcp_socket(AF_INET, SOCK_DGRAM, 0);
+    if(listener.sd == -1 || microtcp_bind(&listener, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 ||
+       microtcp_listen(&listener, 1) == -1){
+        printf("(!) Could not listen!\n");
+        exit(EXIT_FAILURE);
+    }
+    peer = socket(AF_INET, SOCK_DGRAM, 0);
+    if(peer == -1 || connect(peer, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 ||
+       setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1){
+        perror("(!) Peer could not connect");
+        exit(EXIT_FAILURE);
+    }
+
+    //The listener's timer wheel sends the SYN-ACK again once MICROTCP_SYN_RTO_US passed without an ACK
+    sent = now_us();
+    peer_send(MICROTCP_CTRL_SYN, PEER_ISN, 0, MICROTCP_MSS, NULL, 0, 0);
+    if(!peer_recv(MICROTCP_CTRL_SYN | MICROTCP_CTRL_ACK, &synack) || synack.ack_number != PEER_ISN + 1){
+        printf("(!) No SYN-ACK!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(!peer_recv(MICROTCP_CTRL_SYN | MICROTCP_CTRL_ACK, &again) || again.seq_number != synack.seq_number){
+        printf("(!) SYN-ACK not retransmitted!\n");
+        exit(EXIT_FAILURE);
+    }
+    resent = now_us() - sent;
+    if(resent < MICROTCP_SYN_RTO_US / 2 || resent > 3 * MICROTCP_SYN_RTO_US){
+        printf("(!) SYN-ACK retransmitted after %llu us!\n", (unsigned long long)resent);
+        exit(EXIT_FAILURE);
+    }
+
+    peer_send(MICROTCP_CTRL_ACK, PEER_ISN + 1, synack.seq_number + 1, (uint32_t)PEER_CONN_ID << MICROTCP_OPT_CONN_ID_SHIFT, NULL, 0, 0);
+    if(microtcp_accept_conn(&listener, &conn, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) == -1){
+        printf("(!) Handshake not completed!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //All three start right after the SYN, only the last can be taken in
+    for(i = 0; i < sizeof(data); i++) data[i] = i % 251;
+    peer_send(MICROTCP_CTRL_ACK, PEER_ISN + 1, synack.seq_number + 1, (uint32_t)PEER_CONN_ID << MICROTCP_OPT_CONN_ID_SHIFT,
+              data, sizeof(data), sizeof(data));
+    peer_send(MICROTCP_CTRL_ACK, PEER_ISN + 1, synack.seq_number + 1, (uint32_t)PEER_CONN_ID << MICROTCP_OPT_CONN_ID_SHIFT,
+              data, LONG_SEGMENT, 16);
+    peer_send(MICROTCP_CTRL_ACK, PEER_ISN + 1, synack.seq_number + 1, (uint32_t)PEER_CONN_ID << MICROTCP_OPT_CONN_ID_SHIFT,
+              data, LONG_SEGMENT, LONG_SEGMENT);
+    peer_send(MICROTCP_CTRL_ACK, PEER_ISN + 1 + LONG_SEGMENT, synack.seq_number + 1, (uint32_t)PEER_CONN_ID << MICROTCP_OPT_CONN_ID_SHIFT,
+              "done", 4, 4);
+
+    //Had one of the others been taken, the ones after it would be out of order and never arrive
+    received = conn_recv(&conn, buffer, sizeof(buffer));
+    if(received != sizeof(buffer) || memcmp(buffer, data, LONG_SEGMENT) != 0 || memcmp(buffer + LONG_SEGMENT, "done", 4) != 0){
+        printf("(!) Received %zu bytes, not what was sent!\n", received);
+        exit(EXIT_FAILURE);
+    }
+
+    //The backlog is 1, with this handshake open the next SYN gets a cookie
+    peer_send(MICROTCP_CTRL_SYN, HS_ISN, 0, MICROTCP_MSS, NULL, 0, 0);
+    if(!peer_synack(HS_ISN, &again)){
+        printf("(!) No SYN-ACK to fill the backlog!\n");
+        exit(EXIT_FAILURE);
+    }
+    peer_send(MICROTCP_CTRL_SYN, COOKIE_ISN, 0, COOKIE_MSS, NULL, 0, 0);
+    if(!peer_synack(COOKIE_ISN, &cookie)){
+        printf("(!) No SYN-ACK with a cookie!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //A forged cookie and one of two ticks ago. Had either completed a handshake, it would have been queued before the right one
+    peer_send(MICROTCP_CTRL_ACK, COOKIE_ISN + 1, (cookie.seq_number ^ COOKIE_HASH_TOP) + 1, (uint32_t)COOKIE_CONN_ID << MICROTCP_OPT_CONN_ID_SHIFT,
+              NULL, 0, 0);
+    peer_send(MICROTCP_CTRL_ACK, COOKIE_ISN + 1, cookie.seq_number - 2 * COOKIE_TICK + 1, (uint32_t)COOKIE_CONN_ID << MICROTCP_OPT_CONN_ID_SHIFT,
+              NULL, 0, 0);
+    peer_send(MICROTCP_CTRL_ACK, COOKIE_ISN + 1, cookie.seq_number + 1, (uint32_t)COOKIE_CONN_ID << MICROTCP_OPT_CONN_ID_SHIFT,
+              "cookie", 6, 6);
+    if(microtcp_accept_conn(&listener, &cookie_conn, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) == -1){
+        printf("(!) Cookie handshake not completed!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(cookie_conn.seq_number != cookie.seq_number + 1 || cookie_conn.peer_mss != COOKIE_MSS_ENCODED){
+        printf("(!) Cookie connection with ISS %u and MSS %u!\n", cookie_conn.seq_number - 1, cookie_conn.peer_mss);
+        exit(EXIT_FAILURE);
+    }
+    if(conn_recv(&cookie_conn, buffer, 6) != 6 || memcmp(buffer, "cookie", 6) != 0){
+        printf("(!) Data of the cookie ACK not received!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(microtcp_setsockopt(&listener, MICROTCP_SO_NONBLOCK, &on, sizeof(on)) == -1 ||
+       microtcp_accept_conn(&listener, &conn, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) != -1 || errno != EAGAIN){
+        printf("(!) Forged or stale cookie accepted!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("SYN-ACK retransmitted after %llu us, segments longer than the MSS handled, SYN cookies checked\n", (unsigned long long)resent);
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests the sharded server runtime on the loopback: each client gets its
+ * requests echoed by a handler that yields in between, so that the workers
+ * pass the connections around, and the runtime is stopped while the
+ * connections wait on it. The runtime closes them, the clients see the FIN
+ * and answer it.
+ */
+
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<unistd.h>
+#include<string.h>
+#include<errno.h>
+#include<pthread.h>
+#include "../lib/microtcp.h"
+
+#define REQUESTS 8
+
+static struct sockaddr_in server_addr;
+static pthread_barrier_t served;
+
+/* Echoes what arrived, yields while nothing did */
+static int echo(microtcp_sock_t *conn, void *arg){
+    char buffer[64];
+    ssize_t len = microtcp_recv(conn, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    (void)arg;
+    if(len == -1) return errno == EAGAIN ? MICROTCP_TASK_YIELD : MICROTCP_TASK_DONE;
+    if(microtcp_send(conn, buffer, len, 0) != len) return MICROTCP_TASK_DONE;
+    return MICROTCP_TASK_YIELD;
+}
+
+/* A client answers the runtime's FIN on its own thread, the runtime closes the connections in any order */
+static void *client_main(void *arg){
+    microtcp_sock_t client = microtcp_socket(AF_INET, SOCK_DGRAM, 0);
+    char request[32], buffer[32];
+    int i = 0, ok = 1;
+
+    if(client.sd == -1 || microtcp_connect(&client, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1){
+        printf("(!) Could not connect!\n");
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < REQUESTS && ok; i++){
+        snprintf(request, sizeof(request), "client %d request %d", (int)(intptr_t)arg, i);
+        memset(buffer, 0, sizeof(buffer));
+        ok = microtcp_send(&client, request, strlen(request), 0) == (ssize_t)strlen(request)
+             && microtcp_recv(&client, buffer, strlen(request), MSG_WAITALL) == (ssize_t)strlen(request)
+             && strcmp(buffer, request) == 0;
+    }
+    if(!ok) printf("(!) Request not echoed!\n");
+
+    //The handler yielded after the last echo, the connection waits on the runtime for the next request
+    pthread_barrier_wait(&served);
+    if(microtcp_recv(&client, buffer, sizeof(buffer), 0) != -1 || client.state != CLOSING_BY_PEER){
+        printf("(!) Connection not closed by the runtime!\n");
+        return NULL;
+    }
+    microtcp_shutdown(&client, SHUT_RDWR);
+    return ok && client.state == CLOSED ? arg : NULL;
+}
+
+int main(int argc, char **argv){
+    struct microtcp_runtime *rt = NULL;
+    pthread_t *clients = NULL;
+    void *result = NULL;
+    int nworkers = 1, nclients = 1, failed = 0, i = 0;
+
+    if(argc < 2){
+        printf("Execute the command with \"test_microtcp_runtime [port_number] [workers] [clients]\"\n");
+        exit(EXIT_FAILURE);
+    }
+    if(argc > 2) nworkers = atoi(argv[2]);
+    if(argc > 3) nclients = atoi(argv[3]);
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[1]));
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    rt = microtcp_runtime_start((struct sockaddr *)&server_addr, sizeof(server_addr), nworkers, nclients, NULL, echo, NULL);
+    if(rt == NULL){
+        printf("(!) Runtime could not start!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    clients = calloc(nclients, sizeof(pthread_t));
+    if(clients == NULL || pthread_barrier_init(&served, NULL, nclients + 1) != 0){
+        printf("(!) Could not start the clients!\n");
+        exit(EXIT_FAILURE);
+    }
+    //Client numbers start at 1, a client that fails returns NULL
+    for(i = 0; i < nclients; i++){
+        if(pthread_create(&clients[i], NULL, client_main, (void *)(intptr_t)(i + 1)) != 0){
+            printf("(!) Could not start the clients!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&served);
+    if(microtcp_runtime_stop(rt) == -1) failed = 1;
+    for(i = 0; i < nclients; i++){
+        pthread_join(clients[i], &result);
+        if(result == NULL) failed = 1;
+    }
+    pthread_barrier_destroy(&served);
+    free(clients);
+
+    if(failed){
+        printf("(!) Runtime did not serve and stop cleanly!\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Runtime of %d workers served %d clients and stopped with their connections yielded\n", nworkers, nclients);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests the io_uring backend on the loopback: a client and a server, both
+ * created with MICROTCP_SOCK_URING, move a few hundred segments each way.
+ * The server checks every byte the client sent and sends it all back, the
+ * client checks the echo and closes the connection. Where the kernel has no
+ * io_uring the sockets fall back to plain system calls and the transfer
+ * still has to be exact.
+ */
+
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<unistd.h>
+#include<string.h>
+#include<errno.h>
+#include<pthread.h>
+#include "../lib/microtcp.h"
+
+#define TOTAL (512 * 1024)
+#define CHUNK 10000   /* Not a multiple of the MSS, so segments and writes don't line up */
+
+static struct sockaddr_in server_addr;
+static uint8_t sent[TOTAL];
+
+/* Receives the client's bytes, checks them and echoes them back */
+static void *server_main(void *arg){
+    microtcp_sock_t server = microtcp_socket(AF_INET, SOCK_DGRAM | MICROTCP_SOCK_URING, 0);
+    struct sockaddr_in client_addr;
+    static uint8_t buffer[TOTAL];
+    char byte = 0;
+    int *uring = arg;
+
+    if(server.sd == -1 || microtcp_bind(&server, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 ||
+       microtcp_accept(&server, (struct sockaddr *)&client_addr, sizeof(client_addr)) == -1){
+        printf("(!) Could not accept!\n");
+        return NULL;
+    }
+    *uring = server.uring != NULL;
+    if(microtcp_recv(&server, buffer, TOTAL, MSG_WAITALL) != TOTAL || memcmp(buffer, sent, TOTAL) != 0){
+        printf("(!) Server did not receive what was sent!\n");
+        return NULL;
+    }
+    if(microtcp_send(&server, buffer, TOTAL, 0) != TOTAL){
+        printf("(!) Server could not echo!\n");
+        return NULL;
+    }
+    //The client closes once it has the echo
+    if(microtcp_recv(&server, &byte, 1, 0) != -1 || server.state != CLOSING_BY_PEER){
+        printf("(!) Connection not closed by the client!\n");
+        return NULL;
+    }
+    microtcp_shutdown(&server, SHUT_RDWR);
+    return server.state == CLOSED ? arg : NULL;
+}
+
+int main(int argc, char **argv){
+    microtcp_sock_t client;
+    pthread_t server;
+    static uint8_t buffer[TOTAL];
+    void *result = NULL;
+    int server_uring = 0, client_uring = 0, failed = 0;
+    size_t i = 0, len = 0;
+
+    if(argc < 2){
+        printf("Execute the command with \"test_microtcp_uring [port_number]\"\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[1]));
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for(i = 0; i < TOTAL; i++) sent[i] = (i * 131 + (i >> 9)) % 251;
+    if(pthread_create(&server, NULL, server_main, &server_uring) != 0){
+        printf("(!) Could not start the server!\n");
+        exit(EXIT_FAILURE);
+    }
+    //Give the server time to bind, a SYN sent before is sent again anyway
+    usleep(100000);
+
+    client = microtcp_socket(AF_INET, SOCK_DGRAM | MICROTCP_SOCK_URING, 0);
+    if(client.sd == -1 || microtcp_connect(&client, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1){
+        printf("(!) Could not connect!\n");
+        exit(EXIT_FAILURE);
+    }
+    client_uring = client.uring != NULL;
+    for(i = 0; i < TOTAL && !failed; i += len){
+        len = min(CHUNK, TOTAL - i);
+        if(microtcp_send(&client, sent + i, len, 0) != (ssize_t)len) failed = 1;
+    }
+    if(failed || microtcp_recv(&client, buffer, TOTAL, MSG_WAITALL) != TOTAL || memcmp(buffer, sent, TOTAL) != 0){
+        printf("(!) Client did not get the echo!\n");
+        failed = 1;
+    }
+    microtcp_shutdown(&client, SHUT_RDWR);
+    pthread_join(server, &result);
+
+    if(failed || result == NULL || client.state != CLOSED){
+        printf("(!) Transfer was not exact!\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("%d bytes each way, client %s, server %s\n", TOTAL,
+           client_uring ? "through io_uring" : "on plain system calls",
+           server_uring ? "through io_uring" : "on plain system calls");
+    return 0;
+}